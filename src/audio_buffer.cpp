@@ -1,64 +1,687 @@
 #include "audio_buffer.h"
+#include "voice_codec.h"
 #include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <ranges>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 namespace zio {
 
-AudioBuffer::AudioBuffer(size_t capacity_ms, uint32_t sample_rate)
-    : capacity_ms_(capacity_ms), sample_rate_(sample_rate) {}
+namespace {
+// TeamSpeak delivers 10 ms frames; the frame index is bounded for that, so
+// shorter frames shorten the history instead of growing memory.
+constexpr size_t MIN_FRAME_MS = 10;
+
+// Extraction retries when racing eviction at the very start of the window
+constexpr int MAX_EXTRACT_RETRIES = 3;
+
+// Frames peaking within +-SILENCE_PEAK (about -66 dBFS) are stored as
+// silence; a silent run is published at least once per MAX_SILENCE_RUN_MS
+constexpr int16_t SILENCE_PEAK = 16;
+constexpr size_t MAX_SILENCE_RUN_MS = 1000;
+
+bool is_silent(std::span<const int16_t> samples) {
+  // x is within [-P, P] exactly when x + P, taken as unsigned, is <= 2P
+  constexpr uint16_t range = 2 * SILENCE_PEAK;
+  size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+  const __m128i offset = _mm_set1_epi16(SILENCE_PEAK);
+  const __m128i limit = _mm_set1_epi16(range);
+  __m128i excess = _mm_setzero_si128();
+  for (; i + 8 <= samples.size(); i += 8) {
+    __m128i x = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(samples.data() + i));
+    excess = _mm_or_si128(
+        excess, _mm_subs_epu16(_mm_add_epi16(x, offset), limit));
+  }
+  if (_mm_movemask_epi8(_mm_cmpeq_epi16(excess, _mm_setzero_si128())) !=
+      0xFFFF)
+    return false;
+#endif
+  for (; i < samples.size(); ++i) {
+    if (static_cast<uint16_t>(samples[i] + SILENCE_PEAK) > range)
+      return false;
+  }
+  return true;
+}
+} // namespace
+
+AudioBuffer::AudioBuffer(SlabPool &pool, size_t capacity_ms,
+                         uint32_t sample_rate, ClientID client_id,
+                         ServerConnectionHandlerID server_id,
+                         std::shared_ptr<MappedRing> journal)
+    : pool_(pool), capacity_ms_(capacity_ms), sample_rate_(sample_rate),
+      client_id_(client_id), server_id_(server_id),
+      capacity_samples_(std::max<size_t>(ms_to_samples(capacity_ms), 1)),
+      journal_(std::move(journal)),
+      journal_bytes_(journal_ ? journal_->mapped_bytes() : 0),
+      slab_read_(pool.next_sequence_base()),
+      slab_write_(slab_read_.load(std::memory_order_relaxed)),
+      segment_base_(pool.next_sequence_base()) {
+  // Room for the full capacity, the partially filled newest slab, and the
+  // few samples wasted at the end of each slab
+  slab_slots_ =
+      (capacity_samples_ + pool_.slab_samples() - 1) / pool_.slab_samples() +
+      2;
+  // Enough segments for a full index plus the one being started
+  frame_capacity_ = capacity_ms_ / MIN_FRAME_MS + 1;
+  frames_per_segment_ =
+      std::max<size_t>(pool_.slab_bytes() / sizeof(FrameInfo), 1);
+  segment_slots_ =
+      (frame_capacity_ + frames_per_segment_ - 1) / frames_per_segment_ + 1;
 
-size_t AudioBuffer::samples_to_ms(size_t samples) const {
-  return (samples * 1000) / sample_rate_;
+  // Only the rings are allocated up front; segments and slabs are taken
+  // from the pool as audio arrives
+  metadata_bytes_ = (slab_slots_ + segment_slots_) *
+                    sizeof(std::atomic<AudioSlab *>);
+  if (!pool_.try_reserve(metadata_bytes_)) {
+    throw std::runtime_error("Memory budget exhausted");
+  }
+
+  slabs_ = std::make_unique<std::atomic<AudioSlab *>[]>(slab_slots_);
+  segments_ = std::make_unique<std::atomic<AudioSlab *>[]>(segment_slots_);
+}
+
+AudioBuffer::~AudioBuffer() {
+  // Slabs still pinned by pending saves return to the pool when released
+  advance_slab_read(slab_write_.load(std::memory_order_relaxed), false);
+  release_segments();
+  release_spare_slab();
+  pool_.release(metadata_bytes_);
+}
+
+void AudioBuffer::bind(ClientID client_id,
+                       ServerConnectionHandlerID server_id) {
+  client_id_ = client_id;
+  server_id_ = server_id;
+}
+
+void AudioBuffer::reset() {
+  // Evict everything as the destructor does; the sequence numbers keep
+  // counting, so stale references from before the reset never match
+  advance_frame_read(frame_write_.load(std::memory_order_relaxed));
+  advance_slab_read(slab_write_.load(std::memory_order_relaxed), false);
+  release_segments();
+  release_spare_slab();
+  cold_cursor_ = slab_write_.load(std::memory_order_relaxed);
+  dropped_frames_.store(0, std::memory_order_relaxed);
+
+  slab_fill_ = 0;
+  next_position_.store(0, std::memory_order_relaxed);
+  silence_start_ = 0;
+  silence_samples_ = 0;
+  silence_channels_ = 0;
+
+  if (journal_) {
+    journal_->clear();
+    journal_position_ = 0;
+  }
+}
+
+void AudioBuffer::attach_journal(std::shared_ptr<MappedRing> journal) {
+  journal_ = std::move(journal);
+  journal_position_ = 0;
+  journal_bytes_.store(journal_ ? journal_->mapped_bytes() : 0,
+                       std::memory_order_relaxed);
+}
+
+std::shared_ptr<MappedRing> AudioBuffer::detach_journal() {
+  journal_bytes_.store(0, std::memory_order_relaxed);
+  journal_position_ = 0;
+  return std::exchange(journal_, nullptr);
+}
+
+void AudioBuffer::sync_journal() {
+  if (!journal_)
+    return;
+  journal_->set_owner(client_id_, server_id_);
+  // Published frames never change, so the ones after the last mirrored
+  // frame are exactly what the journal is missing
+  for (const AudioChunk &chunk :
+       extract_range(journal_position_, UINT64_MAX)) {
+    if (chunk.silent_samples > 0) {
+      journal_->append_silence(chunk.silent_samples, chunk.position,
+                               chunk.channels);
+    } else {
+      journal_->append(chunk.data, chunk.position, chunk.channels);
+    }
+    journal_position_ = chunk.position + 1;
+  }
 }
 
 size_t AudioBuffer::ms_to_samples(size_t ms) const {
   return (ms * sample_rate_) / 1000;
 }
 
-void AudioBuffer::push(AudioChunk &&chunk) {
-  std::lock_guard lock(mutex_);
+AudioBuffer::FrameInfo AudioBuffer::frame_at(uint64_t index) const {
+  uint64_t segment = index / frames_per_segment_;
+  AudioSlab *slab =
+      segments_[segment % segment_slots_].load(std::memory_order_acquire);
+  if (!slab || slab->sequence() != segment_base_ + segment)
+    return {};
+  return reinterpret_cast<const FrameInfo *>(
+      slab->data())[index % frames_per_segment_];
+}
 
-  // Add new chunk
-  buffer_.push_back(std::move(chunk));
-  total_samples_ += buffer_.back().data.size();
+AudioBuffer::FrameInfo *AudioBuffer::frame_slot(uint64_t write) {
+  uint64_t segment = write / frames_per_segment_;
+  std::atomic<AudioSlab *> &slot = segments_[segment % segment_slots_];
+  AudioSlab *slab = slot.load(std::memory_order_relaxed);
+  if (!slab || slab->sequence() != segment_base_ + segment) {
+    // The segment this slot held before ended at least a full index ago,
+    // so frame_read_ is past it; unlink it if its retirer has not yet
+    if (segment >= segment_slots_) {
+      retire_segment(segment - segment_slots_);
+    }
 
-  // Remove old chunks if exceeding capacity
-  while (!buffer_.empty() && samples_to_ms(total_samples_) > capacity_ms_) {
-    total_samples_ -= buffer_.front().data.size();
-    buffer_.pop_front();
+    // Take the idle slab, a free one, or else our own oldest audio slab
+    slab = spare_slab_.exchange(nullptr, std::memory_order_acq_rel);
+    if (!slab) {
+      slab = pool_.acquire();
+    }
+    uint64_t open = slab_write_.load(std::memory_order_relaxed);
+    if (!slab && open > 0 && evict_slabs_before(open - 1, true)) {
+      slab = spare_slab_.exchange(nullptr, std::memory_order_acq_rel);
+    }
+    if (!slab)
+      return nullptr;
+
+    slab->claim(segment_base_ + segment);
+    segment_bytes_.fetch_add(slab->memory_bytes(), std::memory_order_relaxed);
+    slot.store(slab, std::memory_order_release);
   }
+  return reinterpret_cast<FrameInfo *>(slab->data()) +
+         write % frames_per_segment_;
 }
 
-std::vector<AudioChunk>
-AudioBuffer::extract_last_n_ms(uint64_t ms, uint64_t until_timestamp_ms) {
-  std::lock_guard lock(mutex_);
-  std::vector<AudioChunk> result;
+void AudioBuffer::retire_segment(uint64_t segment) {
+  // Both the thread that evicted the segment's frames and the producer
+  // about to reuse its slot may get here; only one unlinks it
+  std::atomic<AudioSlab *> &slot = segments_[segment % segment_slots_];
+  AudioSlab *slab = slot.load(std::memory_order_acquire);
+  while (slab && slab->sequence() <= segment_base_ + segment) {
+    if (!slot.compare_exchange_weak(slab, nullptr,
+                                    std::memory_order_acq_rel))
+      continue;
+    segment_bytes_.fetch_sub(slab->memory_bytes(), std::memory_order_relaxed);
+    // Segments are never pinned, so retiring releases them right away
+    if (slab->retire()) {
+      pool_.recycle(slab);
+    }
+    return;
+  }
+}
+
+void AudioBuffer::release_segments() {
+  uint64_t write = frame_write_.load(std::memory_order_relaxed);
+  uint64_t last = write / frames_per_segment_;
+  for (uint64_t i = 0; i < segment_slots_ && i <= last; ++i) {
+    retire_segment(last - i);
+  }
+}
+
+void AudioBuffer::advance_frame_read(uint64_t target) {
+  SlabPool::ReadGuard guard(pool_);
+  uint64_t read = frame_read_.load(std::memory_order_acquire);
+  while (read < target) {
+    // frame_read_ only grows, so if the CAS succeeds nobody else evicted
+    // (and nobody overwrote) the frames we just summed
+    size_t evicted = 0;
+    for (uint64_t i = read; i < target; ++i) {
+      evicted += frame_at(i).sample_count;
+    }
+    if (frame_read_.compare_exchange_weak(read, target,
+                                          std::memory_order_acq_rel)) {
+      total_samples_.fetch_sub(evicted, std::memory_order_relaxed);
+      // Publish the eviction before the frames' slots or slabs are reused,
+      // so a reader that looked at them can tell its copy may be stale
+      std::atomic_thread_fence(std::memory_order_release);
+      // Segments whose last frame was evicted go back to the pool
+      for (uint64_t segment = read / frames_per_segment_;
+           segment < target / frames_per_segment_; ++segment) {
+        retire_segment(segment);
+      }
+      return;
+    }
+  }
+}
+
+void AudioBuffer::advance_slab_read(uint64_t target, bool keep_spare) {
+  uint64_t slab = slab_read_.load(std::memory_order_acquire);
+  if (slab >= target)
+    return;
+
+  SlabPool::ReadGuard guard(pool_);
+  while (slab < target) {
+    if (slab_read_.compare_exchange_weak(slab, slab + 1,
+                                         std::memory_order_acq_rel)) {
+      take_slab(slab, keep_spare);
+      ++slab;
+    }
+  }
+}
+
+void AudioBuffer::take_slab(uint64_t sequence, bool keep_spare) {
+  // Once slab_read_ has moved past a slab, whoever unlinks it from its slot
+  // retires it: the evictor, or the producer about to reuse the slot. The
+  // slot may also hold a cold copy the compressor swapped in meanwhile.
+  std::atomic<AudioSlab *> &slot = slabs_[sequence % slab_slots_];
+  AudioSlab *victim = slot.load(std::memory_order_acquire);
+  while (victim && victim->sequence() <= sequence) {
+    if (!slot.compare_exchange_weak(victim, nullptr,
+                                    std::memory_order_acq_rel))
+      continue;
+    slab_bytes_.fetch_sub(victim->memory_bytes(), std::memory_order_relaxed);
+    if (victim->retire()) {
+      if (keep_spare && !victim->is_cold()) {
+        victim = spare_slab_.exchange(victim, std::memory_order_acq_rel);
+      }
+      if (victim) {
+        pool_.recycle(victim);
+      }
+    }
+    return;
+  }
+}
+
+AudioSlab *AudioBuffer::pin_slab(uint64_t sequence) {
+  SlabPool::ReadGuard guard(pool_);
+  std::atomic<AudioSlab *> &slot = slabs_[sequence % slab_slots_];
+  AudioSlab *slab = slot.load(std::memory_order_acquire);
+  while (slab) {
+    if (slab->try_pin(sequence))
+      return slab;
+    // The compressor may have replaced the slab between our load and pin
+    AudioSlab *current = slot.load(std::memory_order_acquire);
+    if (current == slab)
+      break;
+    slab = current;
+  }
+  return nullptr;
+}
+
+bool AudioBuffer::release_spare_slab() {
+  AudioSlab *spare = spare_slab_.exchange(nullptr, std::memory_order_acq_rel);
+  if (spare) {
+    pool_.recycle(spare);
+  }
+  return spare != nullptr;
+}
+
+bool AudioBuffer::evict_slabs_before(uint64_t limit, bool keep_spare) {
+  uint64_t slab = slab_read_.load(std::memory_order_acquire);
+  if (slab >= limit)
+    return false;
+
+  // Frames are in slab order: drop every frame stored in the oldest slab,
+  // then the slab itself. Retry if another evictor moved frame_read_ while
+  // we were looking, since the frames we searched may have been reused.
+  for (;;) {
+    SlabPool::ReadGuard guard(pool_);
+    uint64_t write = frame_write_.load(std::memory_order_acquire);
+    uint64_t read = frame_read_.load(std::memory_order_acquire);
+    auto frame_numbers = std::views::iota(read, write);
+    auto it = std::ranges::partition_point(
+        frame_numbers, [&](uint64_t i) { return frame_at(i).slab <= slab; });
+    uint64_t end = it == frame_numbers.end() ? write : *it;
+    if (frame_read_.load(std::memory_order_acquire) == read) {
+      advance_frame_read(end);
+      break;
+    }
+  }
+  advance_slab_read(slab + 1, keep_spare);
+  return true;
+}
+
+bool AudioBuffer::evict_oldest_slab() {
+  // Never take the slab the producer is currently filling
+  uint64_t open = slab_write_.load(std::memory_order_acquire);
+  return evict_slabs_before(open - 1, false);
+}
+
+uint64_t AudioBuffer::oldest_position() const {
+  SlabPool::ReadGuard guard(pool_);
+  uint64_t read = frame_read_.load(std::memory_order_acquire);
+  uint64_t write = frame_write_.load(std::memory_order_acquire);
+  return read < write ? frame_at(read).position : UINT64_MAX;
+}
+
+size_t AudioBuffer::compress_slabs_before(uint64_t cutoff_position) {
+  size_t compressed = 0;
+  cold_cursor_ =
+      std::max(cold_cursor_, slab_read_.load(std::memory_order_acquire));
 
-  if (buffer_.empty())
-    return result;
+  // The newest slab is still being filled; everything before it is sealed
+  for (; cold_cursor_ + 1 < slab_write_.load(std::memory_order_acquire);
+       ++cold_cursor_) {
+    uint64_t sequence = cold_cursor_;
+    AudioSlab *slab = pin_slab(sequence);
+    SlabRef hot(slab);
+    if (!slab || slab->is_cold())
+      continue; // already evicted
 
-  // If no until timestamp specified, use the latest timestamp
-  if (until_timestamp_ms == 0) {
-    until_timestamp_ms = buffer_.back().timestamp_ms;
+    // The slab's last frame tells how much of it is used and how old it is
+    uint64_t end;
+    FrameInfo last;
+    {
+      SlabPool::ReadGuard guard(pool_);
+      uint64_t write = frame_write_.load(std::memory_order_acquire);
+      uint64_t read = frame_read_.load(std::memory_order_acquire);
+      auto frame_numbers = std::views::iota(read, write);
+      auto it = std::ranges::partition_point(frame_numbers, [&](uint64_t i) {
+        return frame_at(i).slab <= sequence;
+      });
+      end = it == frame_numbers.end() ? write : *it;
+      if (end == read)
+        continue;
+      last = frame_at(end - 1);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (frame_read_.load(std::memory_order_relaxed) >= end ||
+        last.slab != sequence)
+      continue; // its frames were evicted while we looked
+
+    if (last.position >= cutoff_position)
+      break;
+    size_t used = size_t{last.slab_offset} + last.sample_count;
+    if (used > slab->capacity())
+      continue;
+
+    std::vector<uint8_t> packed = VoiceCodec::encode({slab->data(), used});
+    if (packed.size() >= used * sizeof(int16_t))
+      continue; // not worth it, keep the PCM
+
+    AudioSlab *cold = pool_.make_cold(std::move(packed), used);
+    if (!cold)
+      break; // no budget left for it; try again next time
+    cold->claim(sequence);
+
+    // Swap the cold copy in unless the hot slab was unlinked meanwhile.
+    // Our pin makes the hot slab's recycling wait for hot.reset().
+    std::atomic<AudioSlab *> &slot = slabs_[sequence % slab_slots_];
+    AudioSlab *expected = slab;
+    if (slot.compare_exchange_strong(expected, cold,
+                                     std::memory_order_acq_rel)) {
+      slab_bytes_.fetch_add(cold->memory_bytes(), std::memory_order_relaxed);
+      slab_bytes_.fetch_sub(slab->memory_bytes(), std::memory_order_relaxed);
+      slab->retire();
+      ++compressed;
+    } else if (cold->retire()) {
+      pool_.recycle(cold);
+    }
   }
+  return compressed;
+}
 
-  // Calculate the minimum timestamp to include
-  uint64_t min_timestamp =
-      (until_timestamp_ms > ms) ? until_timestamp_ms - ms : 0;
+void AudioBuffer::evict_frames_for(uint64_t write, size_t samples) {
+  // Remove old frames until a frame of this size fits
+  SlabPool::ReadGuard guard(pool_);
+  uint64_t read = frame_read_.load(std::memory_order_acquire);
+  size_t total = total_samples_.load(std::memory_order_relaxed);
+  uint64_t new_read = read;
+  while (new_read < write && (total + samples > capacity_samples_ ||
+                              write - new_read == frame_capacity_)) {
+    total -= frame_at(new_read).sample_count;
+    ++new_read;
+  }
+  advance_frame_read(new_read);
+}
+
+void AudioBuffer::flush_silence() {
+  if (silence_samples_ == 0)
+    return;
+
+  // A silence record stores no samples; it is filed under the newest slab
+  // so frames stay in slab order, and is evicted together with it
+  uint64_t write = frame_write_.load(std::memory_order_relaxed);
+  evict_frames_for(write, 0);
+  FrameInfo *frame = frame_slot(write);
+  if (!frame) {
+    dropped_frames_.fetch_add(1, std::memory_order_relaxed);
+    silence_samples_ = 0;
+    return;
+  }
+  *frame = {silence_start_,
+            slab_write_.load(std::memory_order_relaxed) - 1,
+            static_cast<uint32_t>(slab_fill_),
+            0,
+            silence_channels_,
+            silence_samples_};
+  frame_write_.store(write + 1, std::memory_order_release);
+  silence_samples_ = 0;
+}
+
+void AudioBuffer::push(std::span<const int16_t> samples,
+                       uint64_t position, uint16_t channels) {
+  // A frame larger than a slab keeps only its most recent samples
+  size_t max_frame = std::min(pool_.slab_samples(), capacity_samples_);
+  if (samples.size() > max_frame) {
+    samples = samples.last(max_frame);
+  }
+  if (samples.empty())
+    return;
+  channels = std::max<uint16_t>(channels, 1);
+  next_position_.store(position + samples.size() / channels,
+                       std::memory_order_relaxed);
 
-  // Find chunks within the time range
-  for (const auto &chunk : buffer_) {
-    if (chunk.timestamp_ms >= min_timestamp &&
-        chunk.timestamp_ms <= until_timestamp_ms) {
-      result.push_back(chunk);
+  if (is_silent(samples)) {
+    // A run only grows while the stream continues without a gap
+    if (silence_samples_ > 0 &&
+        (channels != silence_channels_ ||
+         position != silence_start_ + silence_samples_ / channels ||
+         silence_samples_ + samples.size() >
+             ms_to_samples(MAX_SILENCE_RUN_MS))) {
+      flush_silence();
+    }
+    if (silence_samples_ == 0) {
+      silence_start_ = position;
+      silence_channels_ = channels;
     }
+    silence_samples_ += static_cast<uint32_t>(samples.size());
+    return;
   }
+  flush_silence();
+
+  // Other threads may evict our oldest frames and slabs concurrently, but
+  // only the producer writes frames or opens slabs
+  uint64_t write = frame_write_.load(std::memory_order_relaxed);
+  evict_frames_for(write, samples.size());
+  FrameInfo *frame = frame_slot(write);
+  if (!frame) {
+    dropped_frames_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  // Release slabs no frame refers to any more; keep appending to the newest
+  // one while the frame fits
+  uint64_t slab_write = slab_write_.load(std::memory_order_relaxed);
+  bool need_slab = slab_write == slab_read_.load(std::memory_order_acquire) ||
+                   slab_fill_ + samples.size() > pool_.slab_samples();
+  uint64_t keep_from = need_slab ? slab_write : slab_write - 1;
+  {
+    SlabPool::ReadGuard guard(pool_);
+    uint64_t read = frame_read_.load(std::memory_order_acquire);
+    if (read < write) {
+      keep_from = std::min(keep_from, frame_at(read).slab);
+    }
+  }
+  advance_slab_read(keep_from, true);
+
+  if (need_slab) {
+    // Opening a slab with the slab ring full evicts the oldest slab
+    while (slab_write + 1 - slab_read_.load(std::memory_order_acquire) >
+           slab_slots_) {
+      evict_slabs_before(slab_write, true);
+    }
 
-  return result;
+    // With no idle slab in the pool, recycle our own oldest slab before
+    // giving up on the frame. Only try once: if a save has it pinned, more
+    // eviction would throw away history without freeing anything.
+    AudioSlab *slab = spare_slab_.exchange(nullptr, std::memory_order_acq_rel);
+    if (!slab) {
+      slab = pool_.acquire();
+    }
+    if (!slab && evict_slabs_before(slab_write, true)) {
+      slab = spare_slab_.exchange(nullptr, std::memory_order_acq_rel);
+    }
+    if (!slab) {
+      // Nothing left to recycle: drop the frame rather than block
+      dropped_frames_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    // An evictor that moved slab_read_ may not have unlinked the slot's
+    // previous slab yet; do it for them instead of overwriting it
+    {
+      SlabPool::ReadGuard guard(pool_);
+      take_slab(slab_write - slab_slots_, true);
+    }
+
+    slab->claim(slab_write);
+    slabs_[slab_write % slab_slots_].store(slab, std::memory_order_release);
+    slab_bytes_.fetch_add(slab->memory_bytes(), std::memory_order_relaxed);
+    slab_write_.store(++slab_write, std::memory_order_release);
+    slab_fill_ = 0;
+  }
+
+  AudioSlab *slab =
+      slabs_[(slab_write - 1) % slab_slots_].load(std::memory_order_relaxed);
+  std::memcpy(slab->data() + slab_fill_, samples.data(),
+              samples.size() * sizeof(int16_t));
+
+  *frame = {position,
+            slab_write - 1,
+            static_cast<uint32_t>(slab_fill_),
+            static_cast<uint32_t>(samples.size()),
+            channels,
+            0};
+  slab_fill_ += samples.size();
+  total_samples_.fetch_add(samples.size(), std::memory_order_relaxed);
+  frame_write_.store(write + 1, std::memory_order_release);
+}
+
+uint64_t AudioBuffer::first_frame_at_or_after(uint64_t begin, uint64_t end,
+                                              uint64_t position) const {
+  // Frames are pushed in position order, so the index is a binary search
+  auto frame_numbers = std::views::iota(begin, end);
+  auto it = std::ranges::partition_point(frame_numbers, [&](uint64_t i) {
+    return frame_at(i).position < position;
+  });
+  return it == frame_numbers.end() ? end : *it;
+}
+
+std::vector<AudioChunk> AudioBuffer::extract_range(uint64_t from_position,
+                                                   uint64_t until_position) {
+  std::vector<AudioChunk> result;
+  std::vector<FrameInfo> frames;
+  std::vector<uint64_t> frame_numbers;
+
+  for (int attempt = 0;; ++attempt) {
+    result.clear();
+
+    // Locate the window without touching the frames outside it, and copy
+    // its records while the index segments cannot be freed
+    uint64_t first;
+    {
+      SlabPool::ReadGuard guard(pool_);
+      uint64_t write = frame_write_.load(std::memory_order_acquire);
+      uint64_t read = frame_read_.load(std::memory_order_acquire);
+      if (read == write)
+        return result;
+      first = first_frame_at_or_after(read, write, from_position);
+      uint64_t last = first_frame_at_or_after(first, write, until_position);
+      frames.clear();
+      for (uint64_t i = first; i < last; ++i) {
+        frames.push_back(frame_at(i));
+      }
+    }
+
+    result.reserve(frames.size());
+    frame_numbers.clear();
+    SlabRef pinned;
+    std::shared_ptr<const int16_t[]> storage;
+    std::span<const int16_t> samples;
+    uint64_t pinned_slab = UINT64_MAX;
+    for (uint64_t i = first; i < first + frames.size(); ++i) {
+      const FrameInfo &frame = frames[i - first];
+
+      if (frame.silent_samples > 0) {
+        result.push_back({{}, {}, {}, frame.silent_samples, frame.position,
+                          client_id_, server_id_, sample_rate_,
+                          frame.channels});
+        frame_numbers.push_back(i);
+        continue;
+      }
+
+      // Consecutive frames share a slab; pin each slab once, and decode a
+      // cold slab once for all of its frames
+      if (frame.slab != pinned_slab) {
+        pinned_slab = frame.slab;
+        pinned = SlabRef(pin_slab(frame.slab));
+        storage.reset();
+        samples = {};
+        if (pinned && pinned.get()->is_cold()) {
+          size_t count = pinned.get()->capacity();
+          auto pcm = std::make_shared_for_overwrite<int16_t[]>(count);
+          if (VoiceCodec::decode(pinned.get()->packed(), {pcm.get(), count})) {
+            samples = {pcm.get(), count};
+            storage = std::move(pcm);
+          }
+          pinned.reset();
+        } else if (pinned) {
+          samples = {pinned.get()->data(), pinned.get()->capacity()};
+        }
+      }
+
+      // Skip frames whose slab was already retired, and keep views of
+      // frames evicted under us inside the slab
+      if (frame.slab_offset > samples.size() ||
+          frame.sample_count > samples.size() - frame.slab_offset)
+        continue;
+
+      result.push_back({pinned, storage,
+                        samples.subspan(frame.slab_offset, frame.sample_count),
+                        0, frame.position, client_id_, server_id_,
+                        sample_rate_, frame.channels});
+      frame_numbers.push_back(i);
+    }
+
+    // If the producer evicted frames below the window start while we were
+    // searching, a torn position may have misled the search: try again
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t valid_from = frame_read_.load(std::memory_order_relaxed);
+    if (valid_from <= first)
+      return result;
+
+    if (attempt == MAX_EXTRACT_RETRIES) {
+      // Give up on an exact window and just drop the evicted frames
+      auto torn = std::ranges::lower_bound(frame_numbers, valid_from) -
+                  frame_numbers.begin();
+      result.erase(result.begin(), result.begin() + torn);
+      return result;
+    }
+  }
+}
+
+MemoryUsage AudioBuffer::get_memory_usage() const {
+  MemoryUsage usage;
+  usage.payload_bytes = get_size_samples() * sizeof(int16_t);
+  usage.slab_bytes = slab_bytes_.load(std::memory_order_relaxed);
+  usage.metadata_bytes =
+      metadata_bytes_ + segment_bytes_.load(std::memory_order_relaxed);
+  if (spare_slab_.load(std::memory_order_relaxed)) {
+    usage.spare_bytes = pool_.slab_bytes();
+  }
+  usage.journal_bytes = journal_bytes_.load(std::memory_order_relaxed);
+  return usage;
 }
 
 size_t AudioBuffer::get_size_ms() const {
-  std::lock_guard lock(mutex_);
-  return samples_to_ms(total_samples_);
+  return get_size_samples() * 1000 / sample_rate_;
 }
 
 } // namespace zio
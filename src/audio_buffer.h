@@ -1,46 +1,213 @@
 #pragma once
 
+#include "audio_chunk.h"
+#include "mapped_ring.h"
 #include "zio_includes.h"
 
 namespace zio {
 
-struct AudioChunk {
-  std::vector<int16_t> data;
-  uint64_t timestamp_ms;
-  ClientID client_id;
-  ServerConnectionHandlerID server_id;
-  uint32_t sample_rate;
-  uint16_t channels;
-
-  AudioChunk() = default;
-  AudioChunk(const int16_t *samples, size_t count, uint64_t ts_ms, ClientID cid,
-             ServerConnectionHandlerID sid, uint32_t sr = DEFAULT_SAMPLE_RATE,
-             uint16_t ch = 1)
-      : data(samples, samples + count), timestamp_ms(ts_ms), client_id(cid),
-        server_id(sid), sample_rate(sr), channels(ch) {}
+// Memory held by one AudioBuffer, in bytes. Everything but journal_bytes
+// is charged against the SlabPool's budget.
+struct MemoryUsage {
+  // PCM samples of the frames held, as if they were all uncompressed
+  size_t payload_bytes = 0;
+  // Slabs holding them: hot slabs including their unfilled tail, and the
+  // packed size of cold slabs
+  size_t slab_bytes = 0;
+  // Frame index segments in use, plus the slab and segment rings
+  size_t metadata_bytes = 0;
+  // Idle slab kept for the producer's next slab switch
+  size_t spare_bytes = 0;
+  // Size of the memory-mapped journal, paged by the kernel
+  size_t journal_bytes = 0;
+
+  size_t total_bytes() const {
+    return slab_bytes + metadata_bytes + spare_bytes;
+  }
 };
 
+// Fixed-capacity recording buffer for a single client stream.
+//
+// Samples are appended to fixed-size AudioSlabs taken from a shared
+// SlabPool, and every pushed frame is described by a small FrameInfo record
+// in the frame index. The index is stored in segments that are slabs from
+// the same pool, taken as frames arrive and returned as frames are evicted,
+// so a buffer only pays for the index of the audio it actually holds.
+// Pushing a frame is a copy into the current slab plus an index update.
+//
+// Near-silent frames are not stored: consecutive ones are merged into a
+// single silence record that takes no slab space and does not count toward
+// the capacity, so pauses in a conversation do not push out speech.
+//
+// push() must only be called from one thread (the TeamSpeak audio thread)
+// and never blocks. Readers snapshot the published frame indices, pin the
+// slabs they need, and drop any frames the producer evicted in the meantime.
+// Evicted slabs are recycled only after every reader has unpinned them.
+//
+// Besides the producer, any thread may evict the oldest slab to enforce the
+// recorder-wide memory budget; evictions advance the read indices with CAS,
+// so they never wait on the producer or on each other.
+//
+// Frames are placed on the recorder's sample timeline by position: the
+// first sample of each frame has a 64-bit position, and all windowing is
+// done on positions.
+//
+// A maintenance thread may swap sealed slabs for compressed cold copies with
+// compress_slabs_before(). Only the slab pointer in the ring changes, so the
+// frame index stays valid and readers decode cold slabs transparently.
 class AudioBuffer {
 public:
-  AudioBuffer(size_t capacity_ms, uint32_t sample_rate);
-  ~AudioBuffer() = default;
+  // Throws std::runtime_error if the frame metadata does not fit the
+  // pool's memory budget. If a journal is given, published frames are
+  // mirrored to it by sync_journal().
+  AudioBuffer(SlabPool &pool, size_t capacity_ms, uint32_t sample_rate,
+              ClientID client_id = 0, ServerConnectionHandlerID server_id = 0,
+              std::shared_ptr<MappedRing> journal = nullptr);
+  ~AudioBuffer();
+
+  AudioBuffer(const AudioBuffer &) = delete;
+  AudioBuffer &operator=(const AudioBuffer &) = delete;
+
+  // Assigns a buffer created ahead of time to the client it records. Call
+  // before the first push and before the buffer is shared with readers.
+  void bind(ClientID client_id, ServerConnectionHandlerID server_id);
+  ClientID client_id() const { return client_id_; }
+  ServerConnectionHandlerID server_id() const { return server_id_; }
 
-  void push(AudioChunk &&chunk);
-  std::vector<AudioChunk> extract_last_n_ms(uint64_t ms,
-                                            uint64_t until_timestamp_ms = 0);
+  // Positions must not go backwards. next_position() is where a frame
+  // continuing the stream goes, or 0 before the first frame; other threads
+  // may read it to tell how long the stream has been idle.
+  void push(std::span<const int16_t> samples, uint64_t position,
+            uint16_t channels = 1);
+  uint64_t next_position() const {
+    return next_position_.load(std::memory_order_relaxed);
+  }
+  // Drops all audio, including the journal's, so the buffer can be bound
+  // to another client. No other thread may use the buffer meanwhile.
+  void reset();
+  // Copies the frames published since the last call to the journal. Writes
+  // to a file mapping can fault or wait for writeback, so this runs on the
+  // maintenance thread rather than in push(); call from one thread only.
+  void sync_journal();
+  // Start or stop mirroring, from the thread that calls sync_journal(). An
+  // attached journal receives everything the buffer still holds on the
+  // next sync.
+  void attach_journal(std::shared_ptr<MappedRing> journal);
+  std::shared_ptr<MappedRing> detach_journal();
+  const std::shared_ptr<MappedRing> &journal() const { return journal_; }
+  // Frames starting in [from_position, until_position)
+  std::vector<AudioChunk> extract_range(uint64_t from_position,
+                                        uint64_t until_position);
+
+  // Drop the oldest slab other than the one being filled and return it to
+  // the pool. Safe to call from any thread; returns false if there is
+  // nothing to evict.
+  bool evict_oldest_slab();
+  // Return the idle slab kept for the producer's next slab switch, if any
+  bool release_spare_slab();
+  // Position of the oldest frame still held, or UINT64_MAX if empty
+  uint64_t oldest_position() const;
+  // Compress every sealed slab whose newest frame starts before cutoff
+  // and return how many were converted. Call from one thread only.
+  size_t compress_slabs_before(uint64_t cutoff_position);
 
   size_t get_capacity_ms() const { return capacity_ms_; }
   size_t get_size_ms() const;
+  size_t get_size_samples() const {
+    return total_samples_.load(std::memory_order_relaxed);
+  }
+  // Maintained incrementally as slabs are opened, compressed and evicted
+  MemoryUsage get_memory_usage() const;
+  uint64_t get_dropped_frames() const {
+    return dropped_frames_.load(std::memory_order_relaxed);
+  }
 
 private:
+  struct FrameInfo {
+    uint64_t position;    // first sample on the recorder timeline
+    uint64_t slab;        // buffer-local slab sequence number
+    uint32_t slab_offset; // first sample within the slab
+    uint32_t sample_count;
+    uint16_t channels;
+    uint32_t silent_samples; // nonzero for a silence record
+  };
+
+  SlabPool &pool_;
   const size_t capacity_ms_;
   const uint32_t sample_rate_;
+  ClientID client_id_;
+  ServerConnectionHandlerID server_id_;
+  const size_t capacity_samples_;
+  std::shared_ptr<MappedRing> journal_;
+  std::atomic<size_t> journal_bytes_{0}; // for get_memory_usage()
+
+  // Slab ring, indexed by slab sequence number modulo its size. Slabs in
+  // [slab_read_, slab_write_) are live; the newest one is being filled.
+  std::unique_ptr<std::atomic<AudioSlab *>[]> slabs_;
+  size_t slab_slots_;
+  std::atomic<uint64_t> slab_read_;
+  std::atomic<uint64_t> slab_write_;
+
+  // A slab the producer retired unpinned is parked here and reused for its
+  // next slab, which keeps the steady state off the shared free list
+  std::atomic<AudioSlab *> spare_slab_{nullptr};
+
+  // Frame index, by absolute frame number. Frames in [frame_read_,
+  // frame_write_) are valid; the producer advances frame_read_ before it
+  // retires the slab of an evicted frame. Segment k holds frames_per_segment_
+  // records starting at frame k * frames_per_segment_ in a slab claimed with
+  // sequence segment_base_ + k, and sits in slot k modulo the ring size.
+  // Whoever moves frame_read_ past a segment's last frame retires it.
+  std::unique_ptr<std::atomic<AudioSlab *>[]> segments_;
+  size_t segment_slots_;
+  size_t frames_per_segment_;
+  const uint64_t segment_base_;
+  size_t frame_capacity_;
+  std::atomic<size_t> segment_bytes_{0};
+  std::atomic<uint64_t> frame_write_{0};
+  std::atomic<uint64_t> frame_read_{0};
+  std::atomic<size_t> total_samples_{0};
+  // Bytes of the slabs linked in the slab ring
+  std::atomic<size_t> slab_bytes_{0};
+  std::atomic<uint64_t> dropped_frames_{0};
+
+  // Bytes charged to the pool's budget for the slab and segment rings
+  size_t metadata_bytes_ = 0;
+
+  // Written by the producer only
+  std::atomic<uint64_t> next_position_{0};
+
+  // Producer-only state, including the silent run not yet published
+  size_t slab_fill_ = 0;
+  uint64_t silence_start_ = 0;
+  uint32_t silence_samples_ = 0;
+  uint16_t silence_channels_ = 0;
+
+  // Compressor-only state: slabs below this are cold or incompressible
+  uint64_t cold_cursor_ = 0;
+  // sync_journal() state: frames before this position are in the journal
+  uint64_t journal_position_ = 0;
 
-  std::mutex mutex_;
-  std::deque<AudioChunk> buffer_;
-  size_t total_samples_ = 0;
+  // Copy of a frame record, or an all-zero record if its segment was
+  // already retired. Call inside a SlabPool::ReadGuard: a retired segment
+  // is only freed once no reader is left, though it may be reused by then,
+  // so callers check frame_read_ afterwards as for any evicted frame.
+  FrameInfo frame_at(uint64_t index) const;
+  // Record slot for frame index write, taking a new segment if it starts
+  // one; producer only. Returns nullptr if no slab is left for it.
+  FrameInfo *frame_slot(uint64_t write);
+  void retire_segment(uint64_t segment);
+  void release_segments();
+  uint64_t first_frame_at_or_after(uint64_t begin, uint64_t end,
+                                   uint64_t position) const;
+  void evict_frames_for(uint64_t write, size_t samples);
+  void flush_silence();
+  void advance_frame_read(uint64_t target);
+  void advance_slab_read(uint64_t target, bool keep_spare);
+  void take_slab(uint64_t sequence, bool keep_spare);
+  AudioSlab *pin_slab(uint64_t sequence);
+  bool evict_slabs_before(uint64_t limit, bool keep_spare);
 
-  size_t samples_to_ms(size_t samples) const;
   size_t ms_to_samples(size_t ms) const;
 };
 
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "audio_slab.h"
+#include "zio_includes.h"
+
+namespace zio {
+
+// One frame of recorded audio. The samples are a view into a pinned
+// AudioSlab, so copying a chunk never copies PCM; the slab stays alive and
+// unmodified for as long as any chunk referencing it exists. Frames from a
+// cold slab or a recovered MappedRing view memory owned by `storage`.
+// A silent chunk has no data and stands for silent_samples zero samples.
+struct AudioChunk {
+  SlabRef slab;
+  std::shared_ptr<const int16_t[]> storage;
+  std::span<const int16_t> data;
+  uint32_t silent_samples;
+  uint64_t position; // first sample on the recorder timeline
+  ClientID client_id;
+  ServerConnectionHandlerID server_id;
+  uint32_t sample_rate;
+  uint16_t channels;
+
+  size_t sample_count() const { return data.size() + silent_samples; }
+};
+
+} // namespace zio
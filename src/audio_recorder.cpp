@@ -1,4 +1,5 @@
 #include "audio_recorder.h"
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 
@@ -7,146 +8,901 @@ extern struct TS3Functions ts3Functions;
 
 namespace zio {
 
-AudioRecorder::AudioRecorder(uint32_t sample_rate, size_t buffer_capacity_ms)
-    : sample_rate_(sample_rate), file_writer_(std::make_unique<FileWriter>()) {
+namespace {
+// 维护线程的轮询周期
+constexpr auto MAINTENANCE_INTERVAL = std::chrono::milliseconds(50);
+// 池中保持空闲的slab数量，使音频线程总能立即拿到slab：预算充足时由
+// 维护线程预先分配，预算用尽时淘汰旧音频腾出
+constexpr size_t MIN_FREE_SLABS = 8;
+// 预先创建的空闲缓冲区数量，即两次维护之间可以接纳的新客户端数
+constexpr size_t SPARE_BUFFERS = 4;
+// 空闲slab超过该数量时归还给系统，例如回收缓冲区之后
+constexpr size_t MAX_FREE_SLABS = MIN_FREE_SLABS * 4;
+// 离开频道或服务器的客户端的缓冲区保留该时长，使离开后不久的保存
+// 仍包含其音频；仍在频道中的客户端空闲超过缓冲区容量后才回收。
+// 断开的服务器连接在此之后空出其分片
+constexpr uint64_t DEPARTED_GRACE_MS = 120000;
+// anyID的取值个数
+constexpr size_t CLIENT_ID_COUNT = 65536;
+// 流与共享时钟的偏差超过该值（即说话中断）时重新锚定
+constexpr uint64_t MAX_STREAM_DRIFT_MS = 200;
+// 之前会话恢复的环形文件在重新挂载后保留该时长，供save_recovered保存
+constexpr uint64_t RECOVERED_RING_RETENTION_MS = 600000;
+// 保存的后续部分：每隔该时长把新到达的音频追加到文件中
+constexpr auto POST_ROLL_INTERVAL = std::chrono::milliseconds(1000);
+// 混音输出中没有声音的一帧按此记录（10 ms，最多8声道）
+constexpr int16_t SILENT_FRAME[480 * 8] = {};
+
+// 解除映射后删除不再需要的环形文件
+void discard_journal(std::shared_ptr<MappedRing> journal) {
+  if (!journal)
+    return;
+  std::filesystem::path ring_path = journal->path();
+  journal.reset();
+  std::error_code ec;
+  std::filesystem::remove(ring_path, ec);
+}
+
+// 运行中丢弃多余的缓冲区：环形文件随之删除，否则持久化目录只增不减。
+// 录音器析构时直接delete，文件留给下次启动恢复
+void discard_buffer(AudioBuffer *buffer) {
+  auto journal = buffer->detach_journal();
+  delete buffer;
+  discard_journal(std::move(journal));
+}
+} // namespace
+
+AudioRecorder::ServerShard::ServerShard(ServerConnectionHandlerID server_id,
+                                        size_t memory_budget_bytes)
+    : server_id(server_id),
+      slab_pool(std::make_unique<SlabPool>(DEFAULT_SLAB_SAMPLES,
+                                           memory_budget_bytes)),
+      buffer_list(std::make_shared<const BufferList>()),
+      buffer_directory(
+          std::make_unique<std::atomic<AudioBuffer *>[]>(CLIENT_ID_COUNT)),
+      // 领用后放回及补充之间的竞争可能使队列暂时超出SPARE_BUFFERS
+      spare_buffers(SPARE_BUFFERS * 2), claimed_buffers(SPARE_BUFFERS * 2),
+      reclaimed_buffers(SPARE_BUFFERS * 16) {
+  slab_pool->replenish(MIN_FREE_SLABS);
+}
+
+AudioRecorder::ServerShard::~ServerShard() {
+  // 所有缓冲区须在slab池之前释放；快照中的缓冲区先交回reclaimed_buffers
+  buffer_list.store(nullptr);
+  AudioBuffer *buffer = nullptr;
+  while (spare_buffers.try_pop(buffer) || claimed_buffers.try_pop(buffer) ||
+         reclaimed_buffers.try_pop(buffer)) {
+    delete buffer;
+  }
+}
+
+AudioRecorder::AudioRecorder(uint32_t sample_rate, size_t buffer_capacity_ms,
+                             size_t memory_budget_bytes,
+                             size_t writer_threads)
+    : memory_budget_bytes_(memory_budget_bytes),
+      file_writer_(std::make_unique<FileWriter>(writer_threads)),
+      session_id_(std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::system_clock::now().time_since_epoch())
+                      .count()),
+      sample_rate_(sample_rate),
+      buffer_capacity_ms_(buffer_capacity_ms), clock_(sample_rate) {
   file_writer_->start();
+  maintenance_running_ = true;
+  maintenance_thread_ = std::thread(&AudioRecorder::maintenance_thread, this);
   is_recording_ = true; // 默认开始记录
 }
 
-AudioRecorder::~AudioRecorder() { file_writer_->stop(); }
+AudioRecorder::~AudioRecorder() {
+  {
+    std::lock_guard lock(maintenance_mutex_);
+    maintenance_running_ = false;
+  }
+  maintenance_cv_.notify_all();
+  if (maintenance_thread_.joinable()) {
+    maintenance_thread_.join();
+  }
+  file_writer_->stop();
 
-AudioBuffer *AudioRecorder::get_or_create_client_buffer(ClientID client_id) {
-  std::lock_guard lock(buffers_mutex_);
+  for (auto &slot : shards_) {
+    delete slot.exchange(nullptr);
+  }
+}
 
-  auto it = client_buffers_.find(client_id);
-  if (it != client_buffers_.end()) {
-    return it->second.get();
+AudioRecorder::ServerShard *
+AudioRecorder::find_shard(ServerConnectionHandlerID server_id) const {
+  // 分片对象只增不减且数量很少，顺序扫描即可；空出的分片server_id为0
+  for (const auto &slot : shards_) {
+    ServerShard *shard = slot.load(std::memory_order_acquire);
+    if (!shard)
+      break;
+    if (shard->server_id == server_id)
+      return shard;
   }
+  return nullptr;
+}
 
-  // 创建新缓冲区
-  auto buffer =
-      std::make_unique<AudioBuffer>(DEFAULT_BUFFER_CAPACITY_MS, sample_rate_);
-  auto result = client_buffers_.emplace(client_id, std::move(buffer));
-  return result.first->second.get();
+AudioRecorder::ServerShard *
+AudioRecorder::get_or_create_shard(ServerConnectionHandlerID server_id) {
+  // 与release_idle_shard在同一把锁下检查和标记连接状态
+  std::lock_guard lock(shards_mutex_);
+  ServerShard *shard = find_shard(server_id);
+  if (!shard) {
+    // 优先复用空出的分片，其次创建新的；池按整个预算创建，
+    // 实际预算由rebalance_budgets分配
+    for (auto &slot : shards_) {
+      ServerShard *candidate = slot.load(std::memory_order_relaxed);
+      if (!candidate) {
+        shard = new ServerShard(server_id, memory_budget_bytes_);
+        slot.store(shard, std::memory_order_release);
+        break;
+      }
+      if (candidate->server_id.load(std::memory_order_relaxed) == 0) {
+        shard = candidate;
+        shard->dropped_frames.store(0, std::memory_order_relaxed);
+        shard->server_id.store(server_id, std::memory_order_release);
+        break;
+      }
+    }
+    if (!shard) {
+      std::cerr << "Too many server connections, not recording server "
+                << server_id << std::endl;
+      return nullptr;
+    }
+    rebalance_budgets();
+    request_maintenance();
+  }
+  shard->connected.store(true, std::memory_order_relaxed);
+  return shard;
 }
 
-uint64_t AudioRecorder::get_current_timestamp_ms() const {
-  return timestamp_to_ms(std::chrono::steady_clock::now());
+void AudioRecorder::release_idle_shard(ServerShard &shard) {
+  uint64_t grace = clock_.ms_to_samples(DEPARTED_GRACE_MS);
+  if (shard.server_id.load(std::memory_order_relaxed) == 0 ||
+      shard.connected.load(std::memory_order_acquire) ||
+      clock_.coarse_now() <
+          shard.disconnected_at.load(std::memory_order_relaxed) + grace)
+    return;
+
+  std::lock_guard lock(shards_mutex_);
+  std::lock_guard buffers_lock(shard.buffers_mutex);
+  if (shard.connected.load(std::memory_order_relaxed) ||
+      !shard.load_buffers()->empty() || !shard.retiring_buffers.empty() ||
+      shard.claimed_buffers.size_approx() != 0)
+    return;
+
+  // 先使之后的查找找不到分片并取出空闲缓冲区，再用读-改-写确认没有
+  // 音频线程仍在回调中：此后进入的线程既找不到分片也领不到缓冲区
+  ServerConnectionHandlerID server_id =
+      shard.server_id.exchange(0, std::memory_order_acq_rel);
+  std::vector<AudioBuffer *> spares;
+  AudioBuffer *buffer = nullptr;
+  while (shard.spare_buffers.try_pop(buffer)) {
+    spares.push_back(buffer);
+  }
+  if (shard.active_writers.fetch_add(0, std::memory_order_acq_rel) != 0 ||
+      shard.claimed_buffers.size_approx() != 0) {
+    // 有缓冲区刚被领用，下个周期再试
+    for (AudioBuffer *spare : spares) {
+      if (!shard.spare_buffers.try_push(spare))
+        discard_buffer(spare);
+    }
+    shard.server_id.store(server_id, std::memory_order_release);
+    return;
+  }
+  for (AudioBuffer *spare : spares) {
+    discard_buffer(spare);
+  }
+  // 预算归零后，空闲slab由后续的维护周期归还
+  rebalance_budgets();
+}
+
+void AudioRecorder::rebalance_budgets() {
+  size_t in_use = 0;
+  for_each_shard([&](const ServerShard &shard) {
+    if (shard.server_id.load(std::memory_order_relaxed) != 0)
+      ++in_use;
+  });
+  for_each_shard([&](ServerShard &shard) {
+    bool used = shard.server_id.load(std::memory_order_relaxed) != 0;
+    shard.slab_pool->set_budget(used ? memory_budget_bytes_ / in_use : 0);
+  });
+}
+
+void AudioRecorder::request_maintenance() {
+  {
+    std::lock_guard lock(maintenance_mutex_);
+    maintenance_requested_ = true;
+  }
+  maintenance_cv_.notify_all();
+}
+
+void AudioRecorder::maintenance_thread() {
+  std::unique_lock lock(maintenance_mutex_);
+  while (maintenance_running_) {
+    maintenance_cv_.wait_for(lock, MAINTENANCE_INTERVAL, [this]() {
+      return !maintenance_running_ || maintenance_requested_;
+    });
+    if (!maintenance_running_)
+      break;
+    maintenance_requested_ = false;
+
+    lock.unlock();
+    clock_.tick();
+    for_each_shard([this](ServerShard &shard) {
+      {
+        std::lock_guard buffers_lock(shard.buffers_mutex);
+        adopt_claimed_buffers(shard);
+        reclaim_idle_buffers(shard);
+        refill_spare_buffers(shard);
+      }
+      sync_journals(shard);
+      compress_cold_audio(shard);
+      enforce_memory_budget(shard);
+      shard.slab_pool->collect_garbage();
+      shard.slab_pool->replenish(MIN_FREE_SLABS);
+      while (shard.slab_pool->free_bytes() >
+                 MAX_FREE_SLABS * shard.slab_pool->slab_bytes() &&
+             shard.slab_pool->trim_free_slab()) {
+      }
+      release_idle_shard(shard);
+    });
+    expire_recovered_rings();
+    lock.lock();
+  }
+}
+
+void AudioRecorder::adopt_claimed_buffers(ServerShard &shard) {
+  AudioBuffer *buffer = nullptr;
+  if (!shard.claimed_buffers.try_pop(buffer))
+    return;
+
+  // 在副本上追加后发布，正在遍历旧快照的读取方不受影响。
+  // 最后一个引用释放时（可能在保存线程中）把缓冲区交回分片复用
+  auto buffers = std::make_shared<BufferList>(*shard.load_buffers());
+  do {
+    buffers->emplace_back(buffer, [&shard](AudioBuffer *released) {
+      if (!shard.reclaimed_buffers.try_push(released))
+        discard_buffer(released);
+    });
+  } while (shard.claimed_buffers.try_pop(buffer));
+  shard.buffer_list.store(std::move(buffers), std::memory_order_release);
+}
+
+void AudioRecorder::reclaim_idle_buffers(ServerShard &shard) {
+  auto buffers = shard.load_buffers();
+  uint64_t now = clock_.coarse_now();
+  uint64_t grace = clock_.ms_to_samples(DEPARTED_GRACE_MS);
+  uint64_t retention = clock_.ms_to_samples(buffer_capacity_ms_);
+  bool connected = shard.connected.load(std::memory_order_relaxed);
+  auto is_retiring = [&shard](const AudioBuffer *buffer) {
+    return std::ranges::find(shard.retiring_buffers, buffer) !=
+           shard.retiring_buffers.end();
+  };
+
+  for (const auto &buffer : *buffers) {
+    uint64_t last = buffer->next_position();
+    if (last == 0 || is_retiring(buffer.get()))
+      continue;
+    uint64_t idle = now > last ? now - last : 0;
+    // 混音音轨不属于任何客户端，只随连接断开而离开
+    bool departed =
+        !connected || (buffer->client_id() != MIXED_PLAYBACK_CLIENT_ID &&
+                       !is_member(shard, buffer->client_id()));
+
+    if (idle > retention || (departed && idle > grace)) {
+      // 先从查找表移除，客户端再次出现时会领用新的缓冲区
+      AudioBuffer *expected = buffer.get();
+      shard.buffer_directory[buffer->client_id()].compare_exchange_strong(
+          expected, nullptr, std::memory_order_acq_rel);
+      shard.retiring_buffers.push_back(buffer.get());
+    } else if (departed) {
+      // 离开的客户端不再写入：宽限期内只保留压缩后的音频
+      buffer->compress_slabs_before(UINT64_MAX);
+      buffer->release_spare_slab();
+    }
+  }
+
+  // 与SlabPool::collect_garbage相同，读-改-写保证此后进入回调的音频线程
+  // 只会看到移除后的查找表。正在进行的保存仍持有旧快照，
+  // 缓冲区在其结束后才交回
+  if (!shard.retiring_buffers.empty() &&
+      shard.active_writers.fetch_add(0, std::memory_order_acq_rel) == 0) {
+    auto remaining = std::make_shared<BufferList>();
+    for (const auto &buffer : *buffers) {
+      if (!is_retiring(buffer.get()))
+        remaining->push_back(buffer);
+    }
+    shard.buffer_list.store(std::move(remaining), std::memory_order_release);
+    shard.retiring_buffers.clear();
+  }
+  buffers.reset();
+
+  // 交回的缓冲区重置后作为空闲缓冲区复用，多余的及空出分片的释放
+  bool in_use = shard.server_id.load(std::memory_order_relaxed) != 0;
+  AudioBuffer *buffer = nullptr;
+  while (shard.reclaimed_buffers.try_pop(buffer)) {
+    if (in_use && shard.spare_buffers.size_approx() < SPARE_BUFFERS) {
+      buffer->reset();
+      if (shard.spare_buffers.try_push(buffer))
+        continue;
+    }
+    discard_buffer(buffer);
+  }
+}
+
+void AudioRecorder::refill_spare_buffers(ServerShard &shard) {
+  ServerConnectionHandlerID server_id =
+      shard.server_id.load(std::memory_order_relaxed);
+  if (server_id == 0)
+    return;
+
+  // 空闲缓冲区不带环形文件，登记后由sync_journals按需附加
+  while (shard.spare_buffers.size_approx() < SPARE_BUFFERS) {
+    // 预算被音频占满时，新客户端的元数据与slab一样按最旧优先腾出空间；
+    // 被保存任务阻挡而腾不出时，下个维护周期再试
+    std::unique_ptr<AudioBuffer> buffer;
+    while (!buffer) {
+      try {
+        buffer = std::make_unique<AudioBuffer>(
+            *shard.slab_pool, buffer_capacity_ms_, sample_rate_, 0, server_id);
+      } catch (const std::runtime_error &) {
+        if (!make_room(shard))
+          return;
+      }
+    }
+    if (!shard.spare_buffers.try_push(buffer.get())) {
+      discard_buffer(buffer.release());
+      return;
+    }
+    buffer.release();
+  }
+}
+
+void AudioRecorder::sync_journals(ServerShard &shard) {
+  // 持久化的音频由维护线程写入映射文件：写映射页可能缺页或等待回写，
+  // 不能放在音频线程中。崩溃时最多丢失一个维护周期的音频
+  std::filesystem::path ring_dir;
+  {
+    std::lock_guard lock(persistence_mutex_);
+    ring_dir = ring_dir_;
+  }
+
+  auto buffers = shard.load_buffers();
+  for (const auto &buffer : *buffers) {
+    // 关闭后删除各自的文件；开启后为还没有文件的缓冲区创建，
+    // 首次同步时写入其仍保存的全部音频
+    if (ring_dir.empty()) {
+      discard_journal(buffer->detach_journal());
+      continue;
+    }
+    if (!buffer->journal()) {
+      try {
+        buffer->attach_journal(MappedRing::create(
+            ring_dir / std::format("{}_{}_{}.zring", session_id_,
+                                   buffer->server_id(), next_ring_number_++),
+            sample_rate_, DEFAULT_RING_CAPACITY_MS, buffer->client_id(),
+            buffer->server_id()));
+      } catch (const std::runtime_error &e) {
+        // 例如磁盘已满：停止持久化，只在内存中记录
+        std::cerr << e.what() << "; crash recovery disabled" << std::endl;
+        disable_persistence();
+        return;
+      }
+    }
+    buffer->sync_journal();
+  }
+}
+
+void AudioRecorder::compress_cold_audio(ServerShard &shard) {
+  // 最近DEFAULT_COLD_AFTER_MS内的音频保持PCM，更早的已封存slab压缩存储
+  uint64_t now = clock_.now();
+  uint64_t hot = clock_.ms_to_samples(DEFAULT_COLD_AFTER_MS);
+  if (now <= hot)
+    return;
+
+  auto buffers = shard.load_buffers();
+  for (const auto &buffer : *buffers) {
+    buffer->compress_slabs_before(now - hot);
+  }
+}
+
+void AudioRecorder::enforce_memory_budget(ServerShard &shard) {
+  // 预算用尽时，从该服务器上持有最旧音频的客户端开始淘汰，
+  // 直到池中有足够的空闲slab（被保存任务固定的slab会稍后才归还）
+  SlabPool &pool = *shard.slab_pool;
+  while (pool.is_exhausted(MIN_FREE_SLABS)) {
+    if (!evict_oldest_audio(shard))
+      break;
+  }
+
+  // 其他连接加入后预算缩小：先释放空闲slab，再按最旧优先淘汰，逐步归还
+  // 超出的部分。每个周期最多淘汰MAX_FREE_SLABS个，不长时间占用维护线程
+  for (size_t i = 0;
+       i < MAX_FREE_SLABS && pool.reserved_bytes() > pool.budget_bytes(); ++i) {
+    if (!pool.trim_free_slab() && !evict_oldest_audio(shard))
+      break;
+    pool.collect_garbage();
+  }
+}
+
+bool AudioRecorder::evict_oldest_audio(ServerShard &shard) {
+  auto buffers = shard.load_buffers();
+  std::vector<std::pair<uint64_t, AudioBuffer *>> by_age;
+  for (const auto &buffer : *buffers) {
+    by_age.emplace_back(buffer->oldest_position(), buffer.get());
+  }
+  std::ranges::sort(by_age);
+
+  // 先回收闲置的备用slab，再淘汰音频；
+  // 只剩正在写入的slab的客户端无法淘汰，跳到下一个
+  if (std::ranges::any_of(by_age, [](const auto &entry) {
+        return entry.second->release_spare_slab();
+      }))
+    return true;
+  if (std::ranges::none_of(by_age, [](const auto &entry) {
+        return entry.second->evict_oldest_slab();
+      }))
+    return false;
+  // 被淘汰的冷slab要回收后才会释放预算
+  shard.slab_pool->collect_garbage();
+  return true;
+}
+
+bool AudioRecorder::make_room(ServerShard &shard) {
+  // 淘汰的热slab回到空闲列表，仍占着预算，随后一并释放
+  SlabPool &pool = *shard.slab_pool;
+  size_t reserved = pool.reserved_bytes();
+  if (!pool.trim_free_slab()) {
+    if (!evict_oldest_audio(shard))
+      return false;
+    pool.trim_free_slab();
+  }
+  pool.collect_garbage();
+  return pool.reserved_bytes() < reserved;
+}
+
+void AudioRecorder::enable_persistence(const std::filesystem::path &dir) {
+  std::error_code ec;
+  std::filesystem::create_directories(dir, ec);
+  if (ec) {
+    std::cerr << "Cannot create ring directory " << dir << ": "
+              << ec.message() << std::endl;
+    return;
+  }
+  {
+    std::lock_guard lock(persistence_mutex_);
+    ring_dir_ = dir;
+  }
+  request_maintenance();
+}
+
+void AudioRecorder::disable_persistence() {
+  {
+    std::lock_guard lock(persistence_mutex_);
+    ring_dir_.clear();
+  }
+  request_maintenance();
+}
+
+bool AudioRecorder::persistence_enabled() const {
+  std::lock_guard lock(persistence_mutex_);
+  return !ring_dir_.empty();
+}
+
+void AudioRecorder::recover_rings(const std::filesystem::path &dir) {
+  std::lock_guard lock(persistence_mutex_);
+  std::error_code ec;
+  // 重新挂载之前会话留下的环形文件，无法识别的文件直接删除
+  for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    if (entry.path().extension() != ".zring")
+      continue;
+    if (auto ring = MappedRing::open(entry.path())) {
+      recovered_rings_.push_back(std::move(ring));
+    } else {
+      std::filesystem::remove(entry.path(), ec);
+    }
+  }
+  recovered_until_ =
+      clock_.now() + clock_.ms_to_samples(RECOVERED_RING_RETENTION_MS);
+}
+
+void AudioRecorder::expire_recovered_rings() {
+  // 重新挂载后保留期已过、且没有保存任务引用时删除文件。
+  // 恢复的音频停在崩溃时，与其距今多久无关
+  std::lock_guard lock(persistence_mutex_);
+  if (recovered_rings_.empty() || clock_.now() < recovered_until_)
+    return;
+  std::erase_if(recovered_rings_, [&](const std::shared_ptr<MappedRing> &ring) {
+    if (ring.use_count() > 1)
+      return false;
+    std::error_code ec;
+    std::filesystem::remove(ring->path(), ec);
+    return true;
+  });
+}
+
+AudioBuffer *AudioRecorder::find_client_buffer(ServerShard &shard,
+                                               ClientID client_id) {
+  std::atomic<AudioBuffer *> &entry = shard.buffer_directory[client_id];
+  AudioBuffer *buffer = entry.load(std::memory_order_acquire);
+  if (buffer) {
+    return buffer;
+  }
+  if (!shard.spare_buffers.try_pop(buffer)) {
+    // 维护线程尚未补充：丢弃这一帧并计数，供状态查询显示
+    shard.dropped_frames.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+
+  // 新客户端：领用空闲缓冲区，由维护线程登记并补充
+  buffer->bind(client_id, shard.server_id);
+  AudioBuffer *existing = nullptr;
+  if (!entry.compare_exchange_strong(existing, buffer,
+                                     std::memory_order_acq_rel)) {
+    shard.spare_buffers.try_push(buffer);
+    return existing;
+  }
+  shard.claimed_buffers.try_push(buffer);
+  return buffer;
+}
+
+void AudioRecorder::record_frame(ServerShard &shard, ClientID client_id,
+                                 std::span<const int16_t> samples,
+                                 int channels) {
+  // 维护线程据此判断从查找表移除的缓冲区是否仍可能被写入
+  shard.active_writers.fetch_add(1, std::memory_order_acq_rel);
+  AudioBuffer *buffer = find_client_buffer(shard, client_id);
+  if (buffer) {
+    // 连续的帧紧接在上一帧之后；首帧、说话中断或落后时钟超过
+    // MAX_STREAM_DRIFT_MS时按精确时钟重新锚定。超前同样多时丢弃这一帧，
+    // 等时钟追上：缓冲区内的位置必须单调，不能往回锚定
+    uint64_t position = buffer->next_position();
+    uint64_t coarse_now = clock_.coarse_now();
+    uint64_t drift = clock_.ms_to_samples(MAX_STREAM_DRIFT_MS);
+    if (position == 0 || coarse_now > position + drift) {
+      position = clock_.now();
+    }
+    if (position <= coarse_now + drift) {
+      buffer->push(samples, position, channels);
+    }
+  }
+  shard.active_writers.fetch_sub(1, std::memory_order_release);
 }
 
 void AudioRecorder::on_edit_playback_voice_data_event(
     ServerConnectionHandlerID server_id, ClientID client_id, short *samples,
     int sample_count, int channels) {
-  if (!is_recording_ || !is_client_in_current_channel(server_id, client_id)) {
+  if (!is_recording_ || recording_mode() != RecordingMode::PerClient) {
+    return;
+  }
+  ServerShard *shard = find_shard(server_id);
+  if (!shard || !is_member(*shard, client_id)) {
     return;
   }
+  record_frame(*shard, client_id,
+               std::span<const int16_t>(
+                   samples, static_cast<size_t>(sample_count) * channels),
+               channels);
+}
 
-  AudioBuffer *buffer = get_or_create_client_buffer(client_id);
-  if (buffer) {
-    AudioChunk chunk(samples, sample_count, get_current_timestamp_ms(),
-                     client_id, server_id, sample_rate_, channels);
-    buffer->push(std::move(chunk));
+void AudioRecorder::on_edit_mixed_playback_voice_data_event(
+    ServerConnectionHandlerID server_id, short *samples, int sample_count,
+    int channels, unsigned int *channel_fill_mask) {
+  if (!is_recording_ || recording_mode() != RecordingMode::MixedPlayback) {
+    return;
   }
+  ServerShard *shard = find_shard(server_id);
+  if (!shard || !shard->connected.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  // 所有说话人共用一条交错多声道的音轨；sample_count是每声道的采样数。
+  // 没有声音的帧记为静音，使音轨保持连续
+  size_t total = static_cast<size_t>(sample_count) * channels;
+  std::span<const int16_t> frame(samples, total);
+  if (*channel_fill_mask == 0) {
+    if (total > std::size(SILENT_FRAME))
+      return;
+    frame = std::span<const int16_t>(SILENT_FRAME, total);
+  }
+  record_frame(*shard, MIXED_PLAYBACK_CLIENT_ID, frame, channels);
 }
 
-void AudioRecorder::on_edit_post_process_voice_data_event(
-    ServerConnectionHandlerID server_id, ClientID client_id, short *samples,
-    int sample_count, int channels, const unsigned int *channel_speaker_array,
-    unsigned int *channel_fill_mask) {
-  // 与on_edit_playback_voice_data_event类似处理
-  on_edit_playback_voice_data_event(server_id, client_id, samples, sample_count,
-                                    channels);
+void AudioRecorder::on_edit_captured_voice_data_event(
+    ServerConnectionHandlerID server_id, short *samples, int sample_count,
+    int channels, bool transmitted) {
+  // 在采集路径上调用，耗时会直接增加发送延迟：与播放回调一样
+  // 只做无锁查找和一次拷贝
+  if (!is_recording_ || !transmitted) {
+    return;
+  }
+  ServerShard *shard = find_shard(server_id);
+  if (!shard) {
+    return;
+  }
+  ClientID own_id = shard->own_client_id.load(std::memory_order_relaxed);
+  if (own_id == 0) {
+    return;
+  }
+  record_frame(*shard, own_id,
+               std::span<const int16_t>(
+                   samples, static_cast<size_t>(sample_count) * channels),
+               channels);
 }
 
-void AudioRecorder::trigger_save(const std::filesystem::path &base_path,
-                                 uint64_t pre_time_ms) {
-  std::lock_guard lock(buffers_mutex_);
+uint64_t AudioRecorder::trigger_save(const std::filesystem::path &base_path,
+                                     uint64_t pre_time_ms,
+                                     uint64_t post_time_ms,
+                                     ServerConnectionHandlerID server_id,
+                                     FileWriter::SaveCallback on_complete) {
+  // 保存最近pre_time_ms的音频；没有后续部分时截止到触发时已到达的帧，
+  // 否则截止到触发后post_time_ms
+  post_time_ms = std::min<uint64_t>(post_time_ms, buffer_capacity_ms_);
+  uint64_t now = clock_.now();
+  uint64_t window = clock_.ms_to_samples(pre_time_ms);
+  uint64_t from_position = now > window ? now - window : 0;
+  uint64_t end_position = now + clock_.ms_to_samples(post_time_ms);
 
-  uint64_t until_timestamp = get_current_timestamp_ms();
-  std::vector<AudioChunk> all_chunks;
+  // 这里只记录所选服务器的缓冲区及各自的提取范围；
+  // 提取和写入都在写入线程中完成。
+  // 被引用的缓冲区在保存结束前不会被回收
+  struct SavedStream {
+    std::shared_ptr<AudioBuffer> buffer;
+    uint64_t from_position;
+    uint64_t until_position;
+  };
+  using SavedStreams = std::vector<std::shared_ptr<SavedStream>>;
+  SavedStreams streams;
+  auto add_new_buffers = [this, server_id, from_position, end_position](
+                             SavedStreams &streams, bool until_now) {
+    for_each_shard([&](ServerShard &shard) {
+      if (server_id != 0 && shard.server_id != server_id)
+        return;
+      {
+        std::lock_guard lock(shard.buffers_mutex);
+        adopt_claimed_buffers(shard);
+      }
+      auto buffers = shard.load_buffers();
+      for (const auto &buffer : *buffers) {
+        if (std::ranges::any_of(streams, [&](const auto &stream) {
+              return stream->buffer == buffer;
+            }))
+          continue;
+        streams.push_back(std::make_shared<SavedStream>(
+            buffer, from_position,
+            until_now ? buffer->next_position() : end_position));
+      }
+    });
+  };
+  add_new_buffers(streams, post_time_ms == 0);
+
+  // 每次调用提取各流上次之后的音频；后续部分中新出现的客户端也加入保存
+  uint64_t settle = clock_.ms_to_samples(MAX_STREAM_DRIFT_MS);
+  auto collect = [this, streams = std::move(streams), add_new_buffers,
+                  end_position, settle, post_time_ms]() mutable {
+    FileWriter::ChunkBatch batch;
+    uint64_t now = clock_.now();
+    if (post_time_ms != 0) {
+      add_new_buffers(streams, false);
+      // 等迟到的帧也写入缓冲区后再结束
+      batch.last = now >= end_position + settle;
+      uint64_t remaining_ms =
+          batch.last ? 0 : clock_.samples_to_ms(end_position + settle - now);
+      batch.next_at =
+          std::chrono::steady_clock::now() +
+          std::min<std::chrono::milliseconds>(
+              POST_ROLL_INTERVAL, std::chrono::milliseconds(remaining_ms));
+      // 继续的流最多落后共享时钟MAX_STREAM_DRIFT_MS加一个维护周期，
+      // 更早的帧都已写入缓冲区，写入器可以把各音轨对齐写到这里
+      if (!batch.last)
+        batch.complete_until = now > 2 * settle ? now - 2 * settle : 0;
+    }
+
+    // 每个缓冲区各自按位置有序，作为独立的流交给写入器，无需整体排序。
+    // 提取（包括解码冷音频）由写入线程池并行执行
+    batch.streams.reserve(streams.size());
+    for (const auto &stream : streams) {
+      batch.streams.push_back([stream]() {
+        auto chunks = stream->buffer->extract_range(stream->from_position,
+                                                    stream->until_position);
+        // 下一次从已提取的最后一帧之后继续，正在写入的帧不会遗漏
+        if (!chunks.empty())
+          stream->from_position = chunks.back().position + 1;
+        return chunks;
+      });
+    }
+    return batch;
+  };
 
-  // 从所有客户端缓冲区提取指定时间范围的音频数据
-  for (const auto &[client_id, buffer] : client_buffers_) {
-    auto client_chunks =
-        buffer->extract_last_n_ms(pre_time_ms, until_timestamp);
-    all_chunks.insert(all_chunks.end(),
-                      std::make_move_iterator(client_chunks.begin()),
-                      std::make_move_iterator(client_chunks.end()));
+  // 提交保存任务，立即返回编号
+  return file_writer_->enqueue_save_task(std::move(collect), base_path,
+                                         std::move(on_complete));
+}
+
+uint64_t AudioRecorder::save_recovered(const std::filesystem::path &base_path,
+                                       uint64_t pre_time_ms,
+                                       ServerConnectionHandlerID server_id,
+                                       FileWriter::SaveCallback on_complete) {
+  std::vector<std::shared_ptr<MappedRing>> rings;
+  {
+    std::lock_guard lock(persistence_mutex_);
+    std::ranges::copy_if(recovered_rings_, std::back_inserter(rings),
+                         [server_id](const auto &ring) {
+                           return server_id == 0 ||
+                                  ring->server_id() == server_id;
+                         });
   }
 
-  // 按时间戳排序
-  std::sort(all_chunks.begin(), all_chunks.end(),
-            [](const AudioChunk &a, const AudioChunk &b) {
-              return a.timestamp_ms < b.timestamp_ms;
-            });
+  // 时间窗口以恢复的音频中最新的一帧（即崩溃时）为终点，而不是现在：
+  // 重启可能远超pre_time_ms。所有环形文件使用同一终点，各音轨保持对齐
+  uint64_t newest = 0;
+  for (const auto &ring : rings) {
+    newest = std::max(newest, ring->newest_position());
+  }
+  uint64_t window = clock_.ms_to_samples(pre_time_ms);
+  uint64_t from_position = newest > window ? newest - window : 0;
 
-  // 提交保存任务
-  file_writer_->enqueue_save_task(std::move(all_chunks), base_path);
+  auto collect = [rings = std::move(rings), from_position]() {
+    FileWriter::ChunkBatch batch;
+    for (const auto &ring : rings) {
+      batch.streams.push_back([ring, from_position]() {
+        return ring->extract(from_position, UINT64_MAX);
+      });
+    }
+    return batch;
+  };
+  return file_writer_->enqueue_save_task(std::move(collect), base_path,
+                                         std::move(on_complete));
 }
 
 void AudioRecorder::set_current_channel(ServerConnectionHandlerID server_id,
                                         uint64_t channel_id) {
-  current_server_id_ = server_id;
-  current_channel_id_ = channel_id;
+  ServerShard *shard = get_or_create_shard(server_id);
+  if (!shard)
+    return;
+  std::lock_guard lock(shard->membership_mutex);
+  // 重连后自己的客户端ID会变化，本地音轨随之换用新的缓冲区
+  anyID own_id = 0;
+  if (ts3Functions.getClientID(server_id, &own_id) == ERROR_ok) {
+    shard->own_client_id.store(own_id, std::memory_order_relaxed);
+  }
+  shard->channel_id.store(channel_id, std::memory_order_relaxed);
+  reload_channel_members(*shard);
 }
 
-bool AudioRecorder::is_client_in_current_channel(
-    ServerConnectionHandlerID server_id, ClientID client_id) const {
-  // 如果未设置当前频道，则记录所有客户端
-  if (current_server_id_ == 0 || current_channel_id_ == 0) {
-    return true;
+void AudioRecorder::on_client_move(ServerConnectionHandlerID server_id,
+                                   ClientID client_id, uint64_t old_channel_id,
+                                   uint64_t new_channel_id) {
+  ServerShard *shard = find_shard(server_id);
+  if (!shard)
+    return;
+  std::lock_guard lock(shard->membership_mutex);
+
+  // 自己换了频道：跟随到新频道并重建成员集合
+  anyID own_id = 0;
+  if (new_channel_id != 0 &&
+      ts3Functions.getClientID(server_id, &own_id) == ERROR_ok &&
+      own_id == client_id) {
+    shard->channel_id.store(new_channel_id, std::memory_order_relaxed);
+    reload_channel_members(*shard);
+    return;
   }
 
-  // 检查服务器连接是否匹配
-  if (server_id != current_server_id_) {
-    return false;
+  uint64_t channel_id = shard->channel_id.load(std::memory_order_relaxed);
+  if (new_channel_id == channel_id) {
+    set_member(*shard, client_id, true);
+  } else if (old_channel_id == channel_id) {
+    set_member(*shard, client_id, false);
   }
+}
 
-  // 使用TeamSpeak API获取客户端信息并检查频道
-  // 使用SDK版本26的API
-  uint64_t client_channel_id = 0;
-  int error = 0;
-
-  // 获取客户端频道ID - 使用正确的常量名称
-  error = ts3Functions.getClientVariableAsUInt64(
-      server_id, client_id, CLIENT_CHANNEL_ID, &client_channel_id);
-  if (error != ERROR_ok) {
-    // 如果获取失败，尝试通过客户端列表获取
-    anyID *client_list = nullptr;
-    error = ts3Functions.getClientList(server_id, &client_list);
-    if (error == ERROR_ok && client_list) {
-      // 遍历客户端列表
-      for (int i = 0; client_list[i] != 0; i++) {
-        if (client_list[i] == client_id) {
-          // 再次尝试获取频道ID
-          error = ts3Functions.getClientVariableAsUInt64(
-              server_id, client_id, CLIENT_CHANNEL_ID, &client_channel_id);
-          if (error == ERROR_ok) {
-            ts3Functions.freeMemory(client_list);
-            return client_channel_id == current_channel_id_;
-          }
-          break;
-        }
-      }
-      ts3Functions.freeMemory(client_list);
+void AudioRecorder::on_connect_status_change(
+    ServerConnectionHandlerID server_id, int new_status) {
+  if (new_status == STATUS_CONNECTION_ESTABLISHED) {
+    // 连接建立后从自己所在的频道开始记录
+    anyID own_id = 0;
+    uint64_t channel_id = 0;
+    if (ts3Functions.getClientID(server_id, &own_id) == ERROR_ok &&
+        ts3Functions.getChannelOfClient(server_id, own_id, &channel_id) ==
+            ERROR_ok) {
+      set_current_channel(server_id, channel_id);
     }
+  } else if (new_status == STATUS_DISCONNECTED) {
+    // 断开后不再记录该服务器，已记录的音频在宽限期内仍可保存
+    if (ServerShard *shard = find_shard(server_id)) {
+      std::lock_guard lock(shard->membership_mutex);
+      shard->disconnected_at.store(clock_.coarse_now(),
+                                   std::memory_order_relaxed);
+      shard->connected.store(false, std::memory_order_release);
+      shard->own_client_id.store(0, std::memory_order_relaxed);
+      shard->channel_id.store(0, std::memory_order_relaxed);
+      reload_channel_members(*shard);
+    }
+  }
+}
+
+void AudioRecorder::set_member(ServerShard &shard, ClientID client_id,
+                               bool member) {
+  uint64_t bit = uint64_t{1} << (client_id % 64);
+  auto &word = shard.channel_members[client_id / 64];
+  if (member) {
+    word.fetch_or(bit, std::memory_order_relaxed);
+  } else {
+    word.fetch_and(~bit, std::memory_order_relaxed);
+  }
+}
+
+void AudioRecorder::reload_channel_members(ServerShard &shard) {
+  for (auto &word : shard.channel_members) {
+    word.store(0, std::memory_order_relaxed);
+  }
+
+  uint64_t channel_id = shard.channel_id.load(std::memory_order_relaxed);
+  if (channel_id == 0)
+    return;
+
+  // 频道切换时遍历一次成员列表，之后由移动事件增量维护
+  anyID *client_list = nullptr;
+  if (ts3Functions.getChannelClientList(shard.server_id, channel_id,
+                                        &client_list) != ERROR_ok ||
+      !client_list)
+    return;
+  for (int i = 0; client_list[i] != 0; i++) {
+    set_member(shard, client_list[i], true);
+  }
+  ts3Functions.freeMemory(client_list);
+}
 
-    // 如果所有方法都失败，默认返回true（记录该客户端）
+bool AudioRecorder::is_member(const ServerShard &shard, ClientID client_id) {
+  // 如果该连接未设置当前频道，则记录所有客户端
+  if (shard.channel_id.load(std::memory_order_relaxed) == 0) {
     return true;
   }
 
-  return client_channel_id == current_channel_id_;
+  uint64_t bit = uint64_t{1} << (client_id % 64);
+  return (shard.channel_members[client_id / 64].load(
+              std::memory_order_relaxed) &
+          bit) != 0;
+}
+
+bool AudioRecorder::is_client_in_current_channel(
+    ServerConnectionHandlerID server_id, ClientID client_id) const {
+  const ServerShard *shard = find_shard(server_id);
+  return shard && is_member(*shard, client_id);
 }
 
 size_t AudioRecorder::get_buffer_size_ms() const {
-  std::lock_guard lock(buffers_mutex_);
   size_t total_ms = 0;
+  size_t buffer_count = 0;
 
-  for (const auto &[client_id, buffer] : client_buffers_) {
-    total_ms += buffer->get_size_ms();
-  }
+  for_each_shard([&](const ServerShard &shard) {
+    auto buffers = shard.load_buffers();
+    for (const auto &buffer : *buffers) {
+      total_ms += buffer->get_size_ms();
+      ++buffer_count;
+    }
+  });
 
-  return client_buffers_.empty() ? 0 : total_ms / client_buffers_.size();
+  return buffer_count == 0 ? 0 : total_ms / buffer_count;
+}
+
+AudioRecorder::MemoryReport AudioRecorder::get_memory_usage() const {
+  MemoryReport report;
+  for_each_shard([&](const ServerShard &shard) {
+    auto buffers = shard.load_buffers();
+    for (const auto &buffer : *buffers) {
+      report.clients.emplace(std::pair(shard.server_id.load(),
+                                       buffer->client_id()),
+                             buffer->get_memory_usage());
+    }
+    report.free_slab_bytes += shard.slab_pool->free_bytes();
+    report.reserved_bytes += shard.slab_pool->reserved_bytes();
+    report.budget_bytes += shard.slab_pool->budget_bytes();
+    report.dropped_frames.emplace(
+        shard.server_id.load(),
+        shard.dropped_frames.load(std::memory_order_relaxed));
+  });
+  return report;
 }
 
 // 添加开始/停止记录的方法
@@ -154,4 +910,8 @@ void AudioRecorder::start_recording() { is_recording_ = true; }
 
 void AudioRecorder::stop_recording() { is_recording_ = false; }
 
+void AudioRecorder::set_recording_mode(RecordingMode mode) {
+  mode_.store(mode, std::memory_order_relaxed);
+}
+
 } // namespace zio
@@ -2,59 +2,253 @@
 
 #include "audio_buffer.h"
 #include "file_writer.h"
+#include "recorder_clock.h"
 
 namespace zio {
 
+// 记录方式：每个客户端各一条音轨，或只记录混音后的播放输出一条音轨。
+// 混音方式下内存和每秒的开销与说话人数无关
+enum class RecordingMode { PerClient, MixedPlayback };
+
 class AudioRecorder {
 public:
+  // memory_budget_bytes 是整个录音器的内存上限，平均分给当前使用中的
+  // 服务器连接，由该连接的所有客户端缓冲区共享；
+  // writer_threads 是同时写入保存的线程数
   AudioRecorder(uint32_t sample_rate = DEFAULT_SAMPLE_RATE,
-                size_t buffer_capacity_ms = DEFAULT_BUFFER_CAPACITY_MS);
+                size_t buffer_capacity_ms = DEFAULT_BUFFER_CAPACITY_MS,
+                size_t memory_budget_bytes = DEFAULT_MEMORY_BUDGET_BYTES,
+                size_t writer_threads = DEFAULT_WRITER_THREADS);
   ~AudioRecorder();
 
-  // TeamSpeak回调处理
+  // TeamSpeak回调处理。各回调的sample_count都是每声道的采样数，
+  // samples中交错存放sample_count * channels个采样。
+  // 每个客户端只从播放回调记录：后处理回调是同一段
+  // 语音经3D定位后的副本，声道数不同，同时记录会使位置前进过快
   void on_edit_playback_voice_data_event(ServerConnectionHandlerID server_id,
                                          ClientID client_id, short *samples,
                                          int sample_count, int channels);
 
-  void on_edit_post_process_voice_data_event(
-      ServerConnectionHandlerID server_id, ClientID client_id, short *samples,
-      int sample_count, int channels, const unsigned int *channel_speaker_array,
-      unsigned int *channel_fill_mask);
+  // 混音后的播放输出，只在RecordingMode::MixedPlayback下记录。
+  // channel_fill_mask为0表示这一帧没有声音
+  void on_edit_mixed_playback_voice_data_event(
+      ServerConnectionHandlerID server_id, short *samples, int sample_count,
+      int channels, unsigned int *channel_fill_mask);
+
+  // 本地麦克风：transmitted为假（未按键说话或静音）的数据不记录。
+  // 本地音轨以自己的客户端ID记录，与其他客户端一样单独成轨
+  void on_edit_captured_voice_data_event(ServerConnectionHandlerID server_id,
+                                         short *samples, int sample_count,
+                                         int channels, bool transmitted);
 
-  // 触发保存
-  void trigger_save(const std::filesystem::path &base_path,
-                    uint64_t pre_time_ms = DEFAULT_PRE_SAVE_TIME_MS);
+  // 触发保存；server_id为0时保存所有服务器连接。只记录快照后立即返回
+  // 保存编号，提取和写入在写入线程中进行，完成后以结果调用on_complete。
+  // post_time_ms不为0时，触发后继续把到达的音频追加到同一批文件中，
+  // 与触发前的pre_time_ms连成一段，到时后才完成。
+  // post_time_ms超过缓冲区容量时按容量截断
+  uint64_t trigger_save(const std::filesystem::path &base_path,
+                        uint64_t pre_time_ms = DEFAULT_PRE_SAVE_TIME_MS,
+                        uint64_t post_time_ms = DEFAULT_POST_SAVE_TIME_MS,
+                        ServerConnectionHandlerID server_id = 0,
+                        FileWriter::SaveCallback on_complete = nullptr);
 
-  // 频道管理
+  // 频道管理：每个服务器连接各自跟踪所在频道，成员集合由TeamSpeak
+  // 事件线程维护，音频线程只做无锁查询
   void set_current_channel(ServerConnectionHandlerID server_id,
                            uint64_t channel_id);
+  void on_client_move(ServerConnectionHandlerID server_id, ClientID client_id,
+                      uint64_t old_channel_id, uint64_t new_channel_id);
+  void on_connect_status_change(ServerConnectionHandlerID server_id,
+                                int new_status);
   bool is_client_in_current_channel(ServerConnectionHandlerID server_id,
                                     ClientID client_id) const;
 
+  // 可选的崩溃恢复，默认关闭：开启后维护线程把每个客户端的音频同时写入
+  // dir下的内存映射文件（每个约29 MB，由内核换页，不计入内存预算）；
+  // 关闭后删除这些文件
+  void enable_persistence(const std::filesystem::path &dir);
+  void disable_persistence();
+  bool persistence_enabled() const;
+  // 重新挂载之前会话在dir下留下的文件，供save_recovered保存。
+  // 只映射已有的文件，与是否开启持久化无关
+  void recover_rings(const std::filesystem::path &dir);
+  // 保存之前会话（崩溃或重载前）恢复的音频：截至其最后一帧的pre_time_ms，
+  // 与当前的录音分开保存。恢复的文件在重新挂载后保留一段时间
+  uint64_t save_recovered(const std::filesystem::path &base_path,
+                          uint64_t pre_time_ms = DEFAULT_PRE_SAVE_TIME_MS,
+                          ServerConnectionHandlerID server_id = 0,
+                          FileWriter::SaveCallback on_complete = nullptr);
+
   // 状态查询
   bool is_recording() const { return is_recording_; }
   size_t get_buffer_size_ms() const;
+  size_t get_buffer_capacity_ms() const { return buffer_capacity_ms_; }
+
+  // 内存使用统计（字节）：每个客户端的明细及所有服务器连接的预算之和
+  struct MemoryReport {
+    std::map<std::pair<ServerConnectionHandlerID, ClientID>, MemoryUsage>
+        clients;
+    size_t free_slab_bytes = 0; // 池中空闲的slab
+    size_t reserved_bytes = 0;  // 已计入预算的全部字节
+    size_t budget_bytes = 0;
+    // 每个服务器连接因没有空闲缓冲区而丢弃的帧
+    std::map<ServerConnectionHandlerID, uint64_t> dropped_frames;
+  };
+  MemoryReport get_memory_usage() const;
 
   // 开始/停止记录
   void start_recording();
   void stop_recording();
 
+  // 运行时切换记录方式；切换前的音轨仍可保存，直到超出缓冲区容量被回收。
+  // 本地麦克风在两种方式下都记录
+  void set_recording_mode(RecordingMode mode);
+  RecordingMode recording_mode() const {
+    return mode_.load(std::memory_order_relaxed);
+  }
+
+  // 之后开始的保存不经过页缓存写入，避免大文件挤掉其他进程的缓存
+  void set_bypass_cache(bool bypass) {
+    file_writer_->set_bypass_cache(bypass);
+  }
+  bool bypass_cache() const { return file_writer_->bypass_cache(); }
+
+  // 同时记录的服务器连接数上限
+  static constexpr size_t MAX_SERVERS = 32;
+
 private:
-  mutable std::mutex buffers_mutex_;
-  std::map<ClientID, std::unique_ptr<AudioBuffer>> client_buffers_;
+  // 已登记缓冲区的只读快照。保存、维护和状态查询无锁加载快照后遍历，
+  // 快照持有的引用保证遍历期间缓冲区不会被释放；登记新缓冲区时
+  // 复制一份再整体替换
+  using BufferList = std::vector<std::shared_ptr<AudioBuffer>>;
+
+  // 一个服务器连接的全部录音状态。各分片有自己的slab池（即预算的一份）和
+  // 锁，一个服务器上的保存或维护不会与另一个服务器的音频写入竞争。
+  // 断开超过宽限期且音频全部回收后，分片释放其缓冲区和slab并空出，
+  // 供之后的连接复用
+  struct ServerShard {
+    ServerShard(ServerConnectionHandlerID server_id,
+                size_t memory_budget_bytes);
+    ~ServerShard();
+
+    // 为0表示分片空闲；只在shards_mutex_下修改
+    std::atomic<ServerConnectionHandlerID> server_id;
+
+    // 必须先于缓冲区构造、后于它们析构
+    std::unique_ptr<SlabPool> slab_pool;
+
+    std::atomic<std::shared_ptr<const BufferList>> buffer_list;
+    // 只序列化慢路径：快照的替换和缓冲区的创建
+    std::mutex buffers_mutex;
+
+    std::shared_ptr<const BufferList> load_buffers() const {
+      return buffer_list.load(std::memory_order_acquire);
+    }
+
+    // 音频线程的无锁查找表：以anyID为下标（512 KiB），指向已分配的缓冲区
+    std::unique_ptr<std::atomic<AudioBuffer *>[]> buffer_directory;
+    // 维护线程预先创建的空闲缓冲区，以及音频线程已领用、尚未登记到
+    // buffer_list的缓冲区。音频线程只在两个无锁队列间移动指针，
+    // 从不分配内存或创建文件
+    MpmcQueue<AudioBuffer *> spare_buffers;
+    MpmcQueue<AudioBuffer *> claimed_buffers;
+    // 新客户端没有空闲缓冲区可领用而丢弃的帧；分片复用时清零
+    std::atomic<uint64_t> dropped_frames{0};
+
+    // 回收：音频线程在回调中时计数，维护线程据此确认从查找表移除的缓冲区
+    // 已无人写入。retiring_buffers只由维护线程访问；最后一个快照引用
+    // 释放后，缓冲区经reclaimed_buffers交回，重置后作为空闲缓冲区复用
+    std::atomic<uint32_t> active_writers{0};
+    std::vector<AudioBuffer *> retiring_buffers;
+    MpmcQueue<AudioBuffer *> reclaimed_buffers;
+    std::atomic<bool> connected{true};
+    std::atomic<uint64_t> disconnected_at{0}; // 断开时的时钟位置
+    // 自己在该服务器上的客户端ID，采集回调据此找到本地音轨的缓冲区；
+    // 未连接时为0
+    std::atomic<ClientID> own_client_id{0};
+
+    // 当前频道的成员：以anyID为下标的原子位图（8 KiB），
+    // 写入方持有membership_mutex
+    std::atomic<uint64_t> channel_id{0};
+    std::array<std::atomic<uint64_t>, 65536 / 64> channel_members{};
+    std::mutex membership_mutex;
+  };
+
+  // 服务器分片：音频线程无锁扫描查找。分片对象在录音器析构前不会释放，
+  // 空出后只换用新的server_id，扫描中的线程不会访问已释放的内存
+  std::array<std::atomic<ServerShard *>, MAX_SERVERS> shards_{};
+  std::mutex shards_mutex_; // 序列化分片的创建、复用和空出
+  size_t memory_budget_bytes_;
+
+  ServerShard *find_shard(ServerConnectionHandlerID server_id) const;
+  // 慢路径：返回的分片已标记为连接，此后不会被空出；分片已满时返回nullptr
+  ServerShard *get_or_create_shard(ServerConnectionHandlerID server_id);
+  // 断开超过宽限期、缓冲区均已回收的分片释放其资源并空出
+  void release_idle_shard(ServerShard &shard);
+  // 在使用中的分片间平均分配内存预算，须持有shards_mutex_
+  void rebalance_budgets();
+  template <typename Fn> void for_each_shard(Fn &&fn) const {
+    for (const auto &slot : shards_) {
+      if (ServerShard *shard = slot.load(std::memory_order_acquire))
+        fn(*shard);
+    }
+  }
+
   std::unique_ptr<FileWriter> file_writer_;
 
-  ServerConnectionHandlerID current_server_id_{0};
-  uint64_t current_channel_id_{0};
+  // 持久化目录（为空表示未启用）及之前会话恢复的环形文件，
+  // 由persistence_mutex_保护
+  std::filesystem::path ring_dir_;
+  std::vector<std::shared_ptr<MappedRing>> recovered_rings_;
+  uint64_t recovered_until_ = 0; // 恢复的文件保留到该位置
+  mutable std::mutex persistence_mutex_;
+  uint64_t session_id_;
+  std::atomic<uint64_t> next_ring_number_{0};
+
+  void set_member(ServerShard &shard, ClientID client_id, bool member);
+  void reload_channel_members(ServerShard &shard);
+  static bool is_member(const ServerShard &shard, ClientID client_id);
   uint32_t sample_rate_;
+  size_t buffer_capacity_ms_;
+
+  // 所有客户端流共用的采样时间轴
+  RecorderClock clock_;
 
   std::atomic<bool> is_recording_{false};
+  std::atomic<RecordingMode> mode_{RecordingMode::PerClient};
+
+  // 后台维护线程：压缩旧音频，回收离开或长期空闲的客户端的缓冲区，
+  // 某个服务器的预算用尽时按最旧优先淘汰其音频
+  std::thread maintenance_thread_;
+  std::atomic<bool> maintenance_running_{false};
+  bool maintenance_requested_ = false; // 由maintenance_mutex_保护
+  std::mutex maintenance_mutex_;
+  std::condition_variable maintenance_cv_;
 
-  // 获取或创建客户端缓冲区
-  AudioBuffer *get_or_create_client_buffer(ClientID client_id);
+  void maintenance_thread();
+  // 不等轮询周期，立即运行一次维护，例如新分片需要空闲缓冲区时
+  void request_maintenance();
+  void adopt_claimed_buffers(ServerShard &shard);
+  // 空闲缓冲区只由维护线程创建：预算不足时需要淘汰旧音频腾出空间
+  void refill_spare_buffers(ServerShard &shard);
+  void reclaim_idle_buffers(ServerShard &shard);
+  void sync_journals(ServerShard &shard);
+  void compress_cold_audio(ServerShard &shard);
+  void enforce_memory_budget(ServerShard &shard);
+  // 淘汰该分片上最旧的一个slab；没有可淘汰的返回false
+  bool evict_oldest_audio(ServerShard &shard);
+  // 把一个slab的字节还给预算：优先释放空闲slab，否则淘汰最旧的音频。
+  // 被读取方阻挡而暂时无法归还时返回false
+  bool make_room(ServerShard &shard);
+  void expire_recovered_rings();
 
-  // 时间戳生成
-  uint64_t get_current_timestamp_ms() const;
+  // 查找客户端缓冲区，首次出现的客户端领用一个空闲缓冲区；
+  // 没有空闲缓冲区时返回nullptr。只在音频线程（播放或采集）调用，
+  // 同一客户端只由其中一个线程写入
+  AudioBuffer *find_client_buffer(ServerShard &shard, ClientID client_id);
+  // 把一帧写入客户端的缓冲区，连续的帧紧接在上一帧之后
+  void record_frame(ServerShard &shard, ClientID client_id,
+                    std::span<const int16_t> samples, int channels);
 };
 
 } // namespace zio
@@ -0,0 +1,170 @@
+#include "audio_slab.h"
+#include <algorithm>
+
+namespace zio {
+
+AudioSlab::AudioSlab(SlabPool &pool, size_t capacity)
+    : pool_(pool), capacity_(capacity),
+      samples_(std::make_unique<int16_t[]>(capacity)) {}
+
+AudioSlab::AudioSlab(SlabPool &pool, std::vector<uint8_t> packed,
+                     size_t samples)
+    : pool_(pool), capacity_(samples), packed_(std::move(packed)) {}
+
+size_t AudioSlab::memory_bytes() const {
+  return is_cold() ? packed_.size() : capacity_ * sizeof(int16_t);
+}
+
+void AudioSlab::claim(uint64_t sequence) {
+  // Publish the new sequence before clearing FREE, so a stale reader that
+  // pins the slab from here on sees a sequence it does not expect
+  sequence_.store(sequence, std::memory_order_seq_cst);
+  state_.fetch_and(~FREE, std::memory_order_seq_cst);
+}
+
+bool AudioSlab::retire() {
+  uint32_t prev = state_.fetch_or(RETIRED, std::memory_order_seq_cst);
+  return (prev & PIN_MASK) == 0 && try_release();
+}
+
+bool AudioSlab::try_pin(uint64_t sequence) {
+  uint32_t prev = state_.fetch_add(1, std::memory_order_seq_cst);
+  if ((prev & (FREE | RETIRED)) != 0 ||
+      sequence_.load(std::memory_order_seq_cst) != sequence) {
+    unpin();
+    return false;
+  }
+  return true;
+}
+
+void AudioSlab::add_pin() { state_.fetch_add(1, std::memory_order_relaxed); }
+
+void AudioSlab::unpin() {
+  uint32_t prev = state_.fetch_sub(1, std::memory_order_acq_rel);
+  if (prev == (RETIRED | 1) && try_release()) {
+    pool_.recycle(this);
+  }
+}
+
+bool AudioSlab::try_release() {
+  // Only one of retire() and the last unpin() wins the transition to FREE
+  uint32_t expected = RETIRED;
+  return state_.compare_exchange_strong(expected, FREE,
+                                        std::memory_order_acq_rel);
+}
+
+SlabPool::SlabPool(size_t slab_samples, size_t budget_bytes)
+    : slab_samples_(slab_samples), max_budget_bytes_(budget_bytes),
+      budget_bytes_(budget_bytes),
+      free_slabs_(std::max<size_t>(budget_bytes / slab_bytes(), 1)) {}
+
+SlabPool::~SlabPool() {
+  // Every buffer and save task is gone by now, so all slabs are either
+  // idle or waiting to be freed
+  AudioSlab *slab = nullptr;
+  while (free_slabs_.try_pop(slab)) {
+    delete slab;
+  }
+  for (slab = retired_.exchange(nullptr); slab;) {
+    delete std::exchange(slab, slab->next_retired_);
+  }
+  for (AudioSlab *pending : pending_free_) {
+    delete pending;
+  }
+}
+
+AudioSlab *SlabPool::acquire() {
+  AudioSlab *slab = nullptr;
+  return free_slabs_.try_pop(slab) ? slab : nullptr;
+}
+
+size_t SlabPool::replenish(size_t min_free) {
+  size_t added = 0;
+  while (free_slabs_.size_approx() < min_free && try_reserve(slab_bytes())) {
+    free_slabs_.try_push(new AudioSlab(*this, slab_samples_));
+    ++added;
+  }
+  return added;
+}
+
+void SlabPool::recycle(AudioSlab *slab) {
+  if (slab->is_cold()) {
+    discard(slab);
+    return;
+  }
+  // The queue holds at least budget / slab_bytes entries, so this cannot fail
+  free_slabs_.try_push(slab);
+}
+
+AudioSlab *SlabPool::make_cold(std::vector<uint8_t> packed, size_t samples) {
+  while (!try_reserve(packed.size())) {
+    if (!trim_free_slab() || collect_garbage() == 0)
+      return nullptr;
+  }
+  return new AudioSlab(*this, std::move(packed), samples);
+}
+
+bool SlabPool::trim_free_slab() {
+  AudioSlab *slab = nullptr;
+  if (!free_slabs_.try_pop(slab))
+    return false;
+  discard(slab);
+  return true;
+}
+
+void SlabPool::discard(AudioSlab *slab) {
+  slab->next_retired_ = retired_.load(std::memory_order_relaxed);
+  while (!retired_.compare_exchange_weak(slab->next_retired_, slab,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed)) {
+  }
+}
+
+size_t SlabPool::collect_garbage() {
+  for (AudioSlab *slab = retired_.exchange(nullptr, std::memory_order_acquire);
+       slab;) {
+    pending_free_.push_back(std::exchange(slab, slab->next_retired_));
+  }
+  if (pending_free_.empty())
+    return 0;
+
+  // A read-modify-write, so a reader that enters after this point is
+  // ordered after the slabs were unlinked and cannot load them any more
+  if (active_readers_.fetch_add(0, std::memory_order_acq_rel) != 0)
+    return 0;
+
+  size_t freed = 0;
+  for (AudioSlab *slab : pending_free_) {
+    freed += slab->memory_bytes();
+    delete slab;
+  }
+  pending_free_.clear();
+  release(freed);
+  return freed;
+}
+
+void SlabPool::set_budget(size_t budget_bytes) {
+  budget_bytes_.store(std::min(budget_bytes, max_budget_bytes_),
+                      std::memory_order_relaxed);
+}
+
+bool SlabPool::try_reserve(size_t bytes) {
+  size_t reserved = reserved_bytes_.load(std::memory_order_relaxed);
+  do {
+    if (reserved + bytes > budget_bytes())
+      return false;
+  } while (!reserved_bytes_.compare_exchange_weak(
+      reserved, reserved + bytes, std::memory_order_relaxed));
+  return true;
+}
+
+void SlabPool::release(size_t bytes) {
+  reserved_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+bool SlabPool::is_exhausted(size_t min_free) const {
+  return reserved_bytes() + slab_bytes() > budget_bytes() &&
+         free_slabs_.size_approx() < min_free;
+}
+
+} // namespace zio
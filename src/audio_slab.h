@@ -0,0 +1,218 @@
+#pragma once
+
+#include "mpmc_queue.h"
+#include "zio_includes.h"
+#include <utility>
+
+namespace zio {
+
+class SlabPool;
+
+// Fixed-size block of PCM samples. An AudioBuffer appends frames to its
+// newest slab and never rewrites samples it has published, so once a slab
+// holds a frame that part of it is immutable until the slab is recycled.
+//
+// A cold slab holds the VoiceCodec encoding of a sealed hot slab instead.
+// It has no PCM of its own: readers decode packed() into capacity() samples.
+//
+// Readers pin a slab before handing out spans into it. The owning buffer
+// retires a slab when it evicts the slab's last frame; a retired slab goes
+// back to its pool only once the last pin is released. Sequence numbers are
+// unique across buffers, so a stale reader can never pin a slab that was
+// recycled into another buffer.
+class AudioSlab {
+public:
+  AudioSlab(SlabPool &pool, size_t capacity);
+  // Cold slab standing for `samples` samples encoded in `packed`
+  AudioSlab(SlabPool &pool, std::vector<uint8_t> packed, size_t samples);
+
+  AudioSlab(const AudioSlab &) = delete;
+  AudioSlab &operator=(const AudioSlab &) = delete;
+
+  int16_t *data() { return samples_.get(); }
+  const int16_t *data() const { return samples_.get(); }
+  size_t capacity() const { return capacity_; }
+
+  bool is_cold() const { return !samples_; }
+  std::span<const uint8_t> packed() const { return packed_; }
+  // Bytes charged to the pool's budget for this slab
+  size_t memory_bytes() const;
+  uint64_t sequence() const {
+    return sequence_.load(std::memory_order_acquire);
+  }
+
+  // Producer side: take ownership of a slab popped from the pool for the
+  // given slab sequence number, and give it back on eviction. retire()
+  // returns true if the slab was unpinned and the caller must recycle it;
+  // otherwise the last unpin() returns it to the pool.
+  void claim(uint64_t sequence);
+  bool retire();
+
+  // Reader side: pin the slab if it still holds the given sequence.
+  bool try_pin(uint64_t sequence);
+  void add_pin();
+  void unpin();
+
+private:
+  static constexpr uint32_t FREE = 1u << 31;
+  static constexpr uint32_t RETIRED = 1u << 30;
+  static constexpr uint32_t PIN_MASK = RETIRED - 1;
+
+  friend class SlabPool;
+
+  bool try_release();
+
+  SlabPool &pool_;
+  const size_t capacity_;
+  std::unique_ptr<int16_t[]> samples_;
+  const std::vector<uint8_t> packed_;
+
+  // Link in the pool's list of slabs waiting to be freed
+  AudioSlab *next_retired_ = nullptr;
+
+  std::atomic<uint64_t> sequence_{UINT64_MAX};
+  std::atomic<uint32_t> state_{FREE}; // pin count plus FREE/RETIRED flags
+};
+
+// RAII pin on an AudioSlab; copying a reference adds another pin.
+class SlabRef {
+public:
+  SlabRef() = default;
+  // Adopts a pin obtained with AudioSlab::try_pin
+  explicit SlabRef(AudioSlab *pinned) : slab_(pinned) {}
+  ~SlabRef() { reset(); }
+
+  SlabRef(const SlabRef &other) : slab_(other.slab_) {
+    if (slab_)
+      slab_->add_pin();
+  }
+  SlabRef(SlabRef &&other) noexcept : slab_(std::exchange(other.slab_, {})) {}
+
+  SlabRef &operator=(const SlabRef &other) {
+    if (this != &other) {
+      SlabRef copy(other);
+      std::swap(slab_, copy.slab_);
+    }
+    return *this;
+  }
+  SlabRef &operator=(SlabRef &&other) noexcept {
+    if (this != &other) {
+      reset();
+      slab_ = std::exchange(other.slab_, {});
+    }
+    return *this;
+  }
+
+  void reset() {
+    if (slab_)
+      std::exchange(slab_, nullptr)->unpin();
+  }
+
+  const AudioSlab *get() const { return slab_; }
+  explicit operator bool() const { return slab_ != nullptr; }
+
+private:
+  AudioSlab *slab_ = nullptr;
+};
+
+// Shared source of AudioSlabs for all client buffers, and the recorder's
+// memory budget. Hot slabs are allocated ahead of demand by replenish() on a
+// background thread and handed out through a lock-free free list, so the
+// audio thread never calls into the allocator; cold slabs are created by the
+// compressor. Other per-client allocations (frame metadata) are charged
+// against the same budget via try_reserve().
+//
+// Slabs are freed only by collect_garbage(), and only once no thread is
+// inside a ReadGuard, so a stale slab pointer loaded from a buffer's slab
+// ring under a guard always points at live memory.
+class SlabPool {
+public:
+  SlabPool(size_t slab_samples, size_t budget_bytes);
+  ~SlabPool();
+
+  SlabPool(const SlabPool &) = delete;
+  SlabPool &operator=(const SlabPool &) = delete;
+
+  // Held while loading slab pointers from a ring and pinning them
+  class ReadGuard {
+  public:
+    explicit ReadGuard(SlabPool &pool) : pool_(pool) {
+      pool_.active_readers_.fetch_add(1, std::memory_order_acq_rel);
+    }
+    ~ReadGuard() {
+      pool_.active_readers_.fetch_sub(1, std::memory_order_release);
+    }
+
+    ReadGuard(const ReadGuard &) = delete;
+    ReadGuard &operator=(const ReadGuard &) = delete;
+
+  private:
+    SlabPool &pool_;
+  };
+
+  // Pops an idle hot slab; never allocates. Returns nullptr when the free
+  // list is empty.
+  AudioSlab *acquire();
+  // Allocates hot slabs until at least min_free are idle or the budget is
+  // spent, and returns how many were added. Call from one thread only.
+  size_t replenish(size_t min_free);
+  // Takes a slab nobody references any more: hot slabs go back to the free
+  // list, cold slabs are freed by the next collect_garbage()
+  void recycle(AudioSlab *slab);
+
+  // Creates a cold slab, making room by trimming idle hot slabs if needed.
+  // Returns nullptr if the budget cannot fit it. The slab is recycled like
+  // any other, or passed to recycle() directly if it is never published.
+  AudioSlab *make_cold(std::vector<uint8_t> packed, size_t samples);
+  // Frees one idle hot slab at the next collection; false if none is idle
+  bool trim_free_slab();
+  // Frees retired slabs once no reader can still see them and returns the
+  // bytes given back to the budget. Call from one thread only.
+  size_t collect_garbage();
+
+  bool try_reserve(size_t bytes);
+  void release(size_t bytes);
+
+  // True when the budget is spent and fewer than min_free slabs are idle,
+  // i.e. someone has to evict audio before the next slab can be handed out
+  bool is_exhausted(size_t min_free) const;
+
+  // Start of a sequence number range no other buffer will use
+  uint64_t next_sequence_base() {
+    return next_stream_.fetch_add(1, std::memory_order_relaxed) << 32;
+  }
+
+  size_t slab_samples() const { return slab_samples_; }
+  size_t slab_bytes() const { return slab_samples_ * sizeof(int16_t); }
+  size_t budget_bytes() const {
+    return budget_bytes_.load(std::memory_order_relaxed);
+  }
+  // Moves the budget, at most up to the one the pool was created with.
+  // Lowering it below reserved_bytes() only stops new reservations; the
+  // owner has to evict to give the excess back.
+  void set_budget(size_t budget_bytes);
+  size_t reserved_bytes() const {
+    return reserved_bytes_.load(std::memory_order_relaxed);
+  }
+  // Idle hot slabs on the free list; only a hint while buffers are active
+  size_t free_bytes() const { return free_slabs_.size_approx() * slab_bytes(); }
+
+private:
+  void discard(AudioSlab *slab);
+
+  const size_t slab_samples_;
+  const size_t max_budget_bytes_;
+  std::atomic<size_t> budget_bytes_;
+
+  MpmcQueue<AudioSlab *> free_slabs_;
+  std::atomic<size_t> reserved_bytes_{0};
+  std::atomic<uint64_t> next_stream_{1};
+
+  // Slabs to free, as an intrusive lock-free stack, and the ones the
+  // collector already took but could not free yet because of readers
+  std::atomic<AudioSlab *> retired_{nullptr};
+  std::vector<AudioSlab *> pending_free_;
+  std::atomic<size_t> active_readers_{0};
+};
+
+} // namespace zio
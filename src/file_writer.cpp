@@ -1,11 +1,49 @@
 #include "file_writer.h"
 #include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 #include <ranges>
 
 namespace zio {
 
-FileWriter::FileWriter() : running_(false) {}
+namespace {
+// Merges streams that are each in position order. A single stream is passed
+// through as is; otherwise a heap over the stream heads yields the chunks in
+// O(N log k) without sorting the whole set.
+std::vector<AudioChunk> merge_streams(FileWriter::ChunkStreams streams) {
+  if (streams.size() == 1)
+    return std::move(streams.front());
+
+  size_t total = 0;
+  for (const auto &stream : streams) {
+    total += stream.size();
+  }
+  std::vector<AudioChunk> merged;
+  merged.reserve(total);
+
+  // (position of the stream's next chunk, stream index), smallest first
+  using Head = std::pair<uint64_t, size_t>;
+  std::priority_queue<Head, std::vector<Head>, std::greater<>> heads;
+  std::vector<size_t> next(streams.size(), 0);
+  for (size_t i = 0; i < streams.size(); ++i) {
+    if (!streams[i].empty())
+      heads.emplace(streams[i].front().position, i);
+  }
+  while (!heads.empty()) {
+    size_t i = heads.top().second;
+    heads.pop();
+    merged.push_back(std::move(streams[i][next[i]++]));
+    if (next[i] < streams[i].size())
+      heads.emplace(streams[i][next[i]].position, i);
+  }
+  return merged;
+}
+} // namespace
+
+FileWriter::FileWriter(size_t thread_count, OutputFile::Backend backend)
+    : thread_count_(std::max<size_t>(thread_count, 1)), backend_(backend),
+      running_(false) {}
 
 FileWriter::~FileWriter() { stop(); }
 
@@ -14,147 +52,446 @@ void FileWriter::start() {
     return;
 
   running_ = true;
-  writer_thread_ = std::thread(&FileWriter::writer_thread, this);
+  for (size_t i = 0; i < thread_count_; ++i) {
+    writer_threads_.emplace_back(&FileWriter::writer_thread, this);
+  }
 }
 
 void FileWriter::stop() {
   if (!running_)
     return;
 
-  running_ = false;
+  {
+    std::lock_guard lock(queue_mutex_);
+    running_ = false;
+  }
   queue_cv_.notify_all();
 
-  if (writer_thread_.joinable()) {
-    writer_thread_.join();
+  for (auto &thread : writer_threads_) {
+    thread.join();
   }
+  writer_threads_.clear();
 }
 
-void FileWriter::enqueue_save_task(std::vector<AudioChunk> chunks,
-                                   const std::filesystem::path &base_path) {
-  if (chunks.empty())
-    return;
+uint64_t FileWriter::enqueue_save_task(ChunkSource source,
+                                       const std::filesystem::path &base_path,
+                                       SaveCallback on_complete) {
+  uint64_t ticket = next_ticket_.fetch_add(1, std::memory_order_relaxed);
 
   std::lock_guard lock(queue_mutex_);
-  task_queue_.push({std::move(chunks), base_path});
-  queue_cv_.notify_one();
+  task_queue_.push({ticket, std::move(source), base_path,
+                    std::move(on_complete), std::chrono::steady_clock::now(),
+                    nullptr});
+  // Threads helping with a save's jobs wait on the same condition
+  queue_cv_.notify_all();
+  return ticket;
 }
 
 void FileWriter::writer_thread() {
-  while (running_) {
-    std::unique_lock lock(queue_mutex_);
-    queue_cv_.wait(lock,
-                   [this]() { return !task_queue_.empty() || !running_; });
+  std::unique_lock lock(queue_mutex_);
+  while (true) {
+    if (!job_queue_.empty()) {
+      auto job = std::move(job_queue_.front());
+      job_queue_.pop();
+      lock.unlock();
+      job();
+      lock.lock();
+      continue;
+    }
 
-    if (!running_ && task_queue_.empty())
-      break;
+    // Saves whose next batch is due (all of them when stopping) go back
+    // behind the queued ones
+    auto now = std::chrono::steady_clock::now();
+    auto next_wake = std::chrono::steady_clock::time_point::max();
+    for (auto it = waiting_tasks_.begin(); it != waiting_tasks_.end();) {
+      if (!running_ || it->next_at <= now) {
+        task_queue_.push(std::move(*it));
+        it = waiting_tasks_.erase(it);
+      } else {
+        next_wake = std::min(next_wake, it->next_at);
+        ++it;
+      }
+    }
 
     if (!task_queue_.empty()) {
       SaveTask task = std::move(task_queue_.front());
       task_queue_.pop();
       lock.unlock();
 
+      bool done = run_save_task(task);
+      lock.lock();
+      if (!done) {
+        waiting_tasks_.push_back(std::move(task));
+        queue_cv_.notify_all();
+      }
+      continue;
+    }
+
+    if (!running_)
+      break;
+    queue_cv_.wait_until(lock, next_wake);
+  }
+}
+
+FileWriter::ChunkStreams
+FileWriter::extract_streams(std::vector<ChunkExtractor> extractors) {
+  ChunkStreams streams(extractors.size());
+  if (extractors.size() <= 1 || thread_count_ == 1) {
+    for (size_t i = 0; i < extractors.size(); ++i) {
+      streams[i] = extractors[i]();
+    }
+    return streams;
+  }
+
+  // Hand the extractors to the pool and work on the job queue until all of
+  // them are done. Jobs never wait, so helping cannot deadlock even when
+  // every thread is inside a save.
+  size_t remaining = extractors.size();
+  std::exception_ptr error;
+  std::unique_lock lock(queue_mutex_);
+  for (size_t i = 0; i < extractors.size(); ++i) {
+    job_queue_.push([&, i]() {
+      std::exception_ptr job_error;
       try {
-        write_multitrack_wav(task);
-      } catch (const std::exception &e) {
-        std::cerr << "Error writing audio file: " << e.what() << std::endl;
+        streams[i] = extractors[i]();
+      } catch (...) {
+        job_error = std::current_exception();
       }
+      std::lock_guard job_lock(queue_mutex_);
+      if (job_error && !error)
+        error = job_error;
+      if (--remaining == 0)
+        queue_cv_.notify_all();
+    });
+  }
+  queue_cv_.notify_all();
+
+  while (remaining > 0) {
+    if (job_queue_.empty()) {
+      queue_cv_.wait(lock);
+      continue;
     }
+    auto job = std::move(job_queue_.front());
+    job_queue_.pop();
+    lock.unlock();
+    job();
+    lock.lock();
   }
+  lock.unlock();
+
+  if (error)
+    std::rethrow_exception(error);
+  return streams;
 }
 
-void FileWriter::write_multitrack_wav(const SaveTask &task) {
-  if (task.chunks.empty())
-    return;
+bool FileWriter::run_save_task(SaveTask &task) {
+  SaveResult result;
+  result.ticket = task.ticket;
+  try {
+    if (!task.recording) {
+      // Generate filenames with the time of the save
+      auto zoned_time = std::chrono::zoned_time{
+          std::chrono::current_zone(), std::chrono::system_clock::now()};
+      task.recording = std::make_unique<Recording>();
+      task.recording->base_path = task.base_path;
+      task.recording->timestamp_str =
+          std::format("{:%Y-%m-%d_%H-%M-%S}", zoned_time);
+      task.recording->bypass_cache = bypass_cache();
+    } else if (!running_) {
+      // Shutting down in the middle of a post-roll: complete the files
+      // with what has been written so far
+      task.source = nullptr;
+    }
+
+    if (task.source) {
+      ChunkBatch batch = task.source();
+      write_multitrack_wav(*task.recording,
+                           extract_streams(std::move(batch.streams)),
+                           batch.complete_until);
+      if (!batch.last) {
+        task.next_at = batch.next_at;
+        return false;
+      }
+    }
 
-  // Group chunks by client ID
-  std::map<ClientID, std::vector<AudioChunk>> chunks_by_client;
-  for (const auto &chunk : task.chunks) {
-    chunks_by_client[chunk.client_id].push_back(chunk);
+    result.files = finish_recording(*task.recording);
+    result.success = true;
+  } catch (const std::exception &e) {
+    result.error = e.what();
+    std::cerr << "Error writing audio file: " << e.what() << std::endl;
   }
+  result.latency = std::chrono::steady_clock::now() - task.enqueued_at;
+  task.recording.reset();
 
-  // Get the start and end timestamps
-  auto [min_ts, max_ts] = std::ranges::minmax_element(
-      task.chunks, [](const AudioChunk &a, const AudioChunk &b) {
-        return a.timestamp_ms < b.timestamp_ms;
-      });
+  if (task.on_complete) {
+    task.on_complete(result);
+  }
+  return true;
+}
 
-  uint64_t start_time = min_ts->timestamp_ms;
-  uint64_t end_time = max_ts->timestamp_ms;
-  uint64_t duration_ms = end_time - start_time;
+void FileWriter::write_multitrack_wav(Recording &recording,
+                                      ChunkStreams streams,
+                                      uint64_t complete_until) {
+  // Group streams by client (client IDs are only unique per server); only
+  // clients with more than one stream need merging
+  std::map<std::pair<ServerConnectionHandlerID, ClientID>, ChunkStreams>
+      streams_by_client;
+  for (auto &stream : streams) {
+    if (stream.empty())
+      continue;
+    const AudioChunk &head = stream.front();
+    streams_by_client[{head.server_id, head.client_id}].push_back(
+        std::move(stream));
+  }
+  std::map<std::pair<ServerConnectionHandlerID, ClientID>,
+           std::vector<AudioChunk>>
+      chunks_by_client;
+  for (auto &[client, client_streams] : streams_by_client) {
+    chunks_by_client.emplace(client, merge_streams(std::move(client_streams)));
+  }
 
-  // Create output directory if needed
-  std::filesystem::create_directories(task.base_path.parent_path());
-
-  // Generate filename with timestamp
-  auto zoned_time = std::chrono::zoned_time{std::chrono::current_zone(),
-                                            std::chrono::system_clock::now()};
-
-  // auto now = std::chrono::system_clock::now();
-  // auto time_t = std::chrono::system_clock::to_time_t(now);
-  std::string timestamp_str = std::format("{:%Y-%m-%d_%H-%M-%S}", zoned_time);
-
-  std::filesystem::path file_path =
-      task.base_path / std::format("ts_record_{}.wav", timestamp_str);
-
-  // Write a separate WAV file for each client
-  for (const auto &[client_id, chunks] : chunks_by_client) {
-    std::filesystem::path client_file_path =
-        task.base_path /
-        std::format("ts_record_{}_client_{}.wav", timestamp_str, client_id);
-
-    // Prepare WAV header
-    WAVHeader header;
-    header.num_channels = 1; // Mono
-    header.sample_rate = chunks.front().sample_rate;
-    header.byte_rate =
-        header.sample_rate * header.num_channels * (header.bits_per_sample / 8);
-    header.block_align = header.num_channels * (header.bits_per_sample / 8);
-
-    // Calculate total data size
-    size_t total_samples = 0;
-    for (const auto &chunk : chunks) {
-      total_samples += chunk.data.size();
+  if (!recording.started) {
+    if (chunks_by_client.empty())
+      return;
+    // All tracks are aligned to the earliest frame of the first batch
+    const AudioChunk *first = nullptr;
+    for (const auto &[client, chunks] : chunks_by_client) {
+      if (!first || chunks.front().position < first->position)
+        first = &chunks.front();
     }
+    recording.started = true;
+    recording.sample_rate = first->sample_rate;
+    recording.start_position = first->position;
+    recording.written_position = first->position;
 
-    header.subchunk2_size = total_samples * (header.bits_per_sample / 8);
-    header.chunk_size = 36 + header.subchunk2_size;
+    // Create output directory if needed
+    std::filesystem::create_directories(recording.base_path);
+  }
+
+  std::vector<std::pair<std::pair<ServerConnectionHandlerID, ClientID>,
+                        uint16_t>>
+      new_clients;
+  for (const auto &[client, chunks] : chunks_by_client) {
+    if (!recording.tracks_by_client.contains(client))
+      new_clients.emplace_back(
+          client, std::max<uint16_t>(chunks.front().channels, 1));
+  }
+  if (!new_clients.empty()) {
+    open_multitrack_file(recording, std::move(new_clients));
+  }
 
-    // Write WAV file
-    std::ofstream file(client_file_path, std::ios::binary);
-    if (!file) {
-      throw std::runtime_error("Cannot open file for writing: " +
-                               client_file_path.string());
+  for (auto &[client, chunks] : chunks_by_client) {
+    Track &track = *recording.tracks_by_client.at(client);
+    for (auto &chunk : chunks) {
+      // A track has a single layout; frames that do not fit it (e.g. from
+      // a session recorded at another rate) are left out
+      if (chunk.sample_rate != recording.sample_rate ||
+          std::max<uint16_t>(chunk.channels, 1) != track.channels)
+        continue;
+      track.end_position =
+          std::max(track.end_position,
+                   chunk.position + chunk.sample_count() / track.channels);
+      track.pending.push_back(std::move(chunk));
+      ++track.chunks;
     }
+  }
 
-    // Write header
-    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  // Write up to where every track is complete, but not past the newest
+  // frame; the rest waits for the next batch
+  uint64_t end_position = recording.written_position;
+  for (const auto &[client, track] : recording.tracks_by_client) {
+    end_position = std::max(end_position, track->end_position);
+  }
+  uint64_t until = std::min(complete_until, end_position);
+  if (until <= recording.written_position)
+    return;
+  // Every file will reach at least the newest frame; for a save that
+  // arrives in one batch this is its final size
+  for (auto &output : recording.files) {
+    output.file->reserve(sizeof(WAVHeader) +
+                         (end_position - recording.start_position) *
+                             output.header.block_align);
+  }
+  for (auto &output : recording.files) {
+    interleave_tracks(output, recording.written_position, until);
+  }
+  recording.written_position = until;
+}
 
-    // Write audio data
-    for (const auto &chunk : chunks) {
-      file.write(reinterpret_cast<const char *>(chunk.data.data()),
-                 chunk.data.size() * sizeof(int16_t));
+void FileWriter::open_multitrack_file(
+    Recording &recording,
+    std::vector<std::pair<std::pair<ServerConnectionHandlerID, ClientID>,
+                          uint16_t>>
+        clients) {
+  MultitrackFile &output = recording.files.emplace_back();
+  std::filesystem::path path =
+      recording.files.size() == 1
+          ? recording.base_path /
+                std::format("ts_record_{}.wav", recording.timestamp_str)
+          : recording.base_path /
+                std::format("ts_record_{}_{}.wav", recording.timestamp_str,
+                            recording.files.size());
+
+  // One track per client, each taking as many channels as its frames have
+  // (the mixed playback track is usually stereo)
+  uint16_t channels = 0;
+  for (const auto &[client, client_channels] : clients) {
+    output.tracks.push_back({client, client_channels, channels, {}});
+    channels += client_channels;
+  }
+  for (auto &track : output.tracks) {
+    recording.tracks_by_client[track.client] = &track;
+  }
+
+  // Prepare WAV header; the sizes are written when the recording is
+  // finished. Client tracks are separate sources rather than speaker
+  // positions, so only a file holding one mono or stereo track gets a
+  // speaker mask
+  WAVHeader &header = output.header;
+  header.num_channels = channels;
+  header.sample_rate = recording.sample_rate;
+  header.byte_rate =
+      header.sample_rate * header.num_channels * (header.bits_per_sample / 8);
+  header.block_align = header.num_channels * (header.bits_per_sample / 8);
+  header.channel_mask = 0;
+  if (output.tracks.size() == 1 && channels <= 2) {
+    header.channel_mask = channels == 1 ? 0x4 : 0x3;
+  }
+  header.riff_size = sizeof(WAVHeader) - 8;
+  header.data_size = 0;
+
+  output.file = OutputFile::create(path, backend_, recording.bypass_cache);
+  std::memcpy(output.file->next_buffer().data(), &header, sizeof(header));
+  output.file->append(sizeof(header));
+
+  // A file opened after the first batch starts with silence up to where
+  // the others are, so all files share the same timeline
+  interleave_tracks(output, recording.start_position,
+                    recording.written_position);
+}
+
+void FileWriter::interleave_tracks(MultitrackFile &output, uint64_t from,
+                                   uint64_t until) {
+  size_t channels = output.header.num_channels;
+
+  // Interleave straight into the file's staging buffers, one whole buffer
+  // per write request
+  for (uint64_t position = from; position < until;) {
+    std::span<char> buffer = output.file->next_buffer();
+    auto *block = reinterpret_cast<int16_t *>(buffer.data());
+    size_t block_frames = buffer.size() / (channels * sizeof(int16_t));
+    size_t frames = std::min<uint64_t>(block_frames, until - position);
+    uint64_t block_end = position + frames;
+    std::fill_n(block, frames * channels, int16_t{0});
+
+    // Copy the part of each track's chunks that falls into the block;
+    // silence records and gaps stay zero
+    for (auto &track : output.tracks) {
+      while (!track.pending.empty()) {
+        const AudioChunk &chunk = track.pending.front();
+        uint64_t chunk_end =
+            chunk.position + chunk.sample_count() / track.channels;
+        if (chunk.position >= block_end)
+          break;
+
+        uint64_t begin = std::max(chunk.position, position);
+        uint64_t end = std::min(chunk_end, block_end);
+        for (uint64_t frame = begin; frame < end && !chunk.data.empty();
+             ++frame) {
+          const int16_t *in =
+              chunk.data.data() + (frame - chunk.position) * track.channels;
+          int16_t *out =
+              block + (frame - position) * channels + track.first_channel;
+          std::copy_n(in, track.channels, out);
+        }
+
+        if (chunk_end > block_end)
+          break;
+        track.pending.pop_front();
+      }
     }
 
-    // Update header with correct sizes (in case of write errors)
-    if (file.tellp() != sizeof(header) + header.subchunk2_size) {
-      std::cerr << "Warning: File size doesn't match expected size"
-                << std::endl;
+    size_t bytes = frames * channels * sizeof(int16_t);
+    output.file->append(bytes);
+    output.data_bytes += bytes;
+    position = block_end;
+  }
+}
+
+std::vector<std::filesystem::path>
+FileWriter::finish_recording(Recording &recording) {
+  std::vector<std::filesystem::path> files;
+  if (!recording.started)
+    return files;
+
+  // Write out what is still pending, up to the end of the longest track
+  write_multitrack_wav(recording, {}, UINT64_MAX);
+
+  // Fill in the header sizes now that the tracks are complete
+  for (auto &output : recording.files) {
+    WAVHeader &header = output.header;
+    uint64_t riff_size = sizeof(WAVHeader) - 8 + output.data_bytes;
+    if (riff_size > UINT32_MAX) {
+      // Too large for RIFF: the real sizes go into the ds64 chunk and the
+      // 32-bit fields are set to -1
+      uint64_t sample_count = output.data_bytes / header.block_align;
+      std::memcpy(header.riff_id, "RF64", 4);
+      std::memcpy(header.ds64_id, "ds64", 4);
+      header.riff_size = UINT32_MAX;
+      header.data_size = UINT32_MAX;
+      header.riff_size_low = static_cast<uint32_t>(riff_size);
+      header.riff_size_high = static_cast<uint32_t>(riff_size >> 32);
+      header.data_size_low = static_cast<uint32_t>(output.data_bytes);
+      header.data_size_high = static_cast<uint32_t>(output.data_bytes >> 32);
+      header.sample_count_low = static_cast<uint32_t>(sample_count);
+      header.sample_count_high = static_cast<uint32_t>(sample_count >> 32);
+    } else {
+      header.riff_size = static_cast<uint32_t>(riff_size);
+      header.data_size = static_cast<uint32_t>(output.data_bytes);
     }
+    output.file->write_at(
+        0, {reinterpret_cast<const char *>(&header), sizeof(header)});
+    output.file->close();
+    files.push_back(output.file->path());
   }
 
-  // Also write a metadata file with timestamps
+  uint32_t rate = recording.sample_rate;
+  uint64_t start_time = recording.start_position * 1000 / rate;
+  uint64_t end_time = recording.written_position * 1000 / rate;
+  uint64_t duration_ms = end_time - start_time;
+
+  // Also write a metadata file with timestamps and the channel of every
+  // client track
   std::filesystem::path meta_file_path =
-      task.base_path / std::format("ts_record_{}_meta.txt", timestamp_str);
+      recording.base_path /
+      std::format("ts_record_{}_meta.txt", recording.timestamp_str);
 
   std::ofstream meta_file(meta_file_path);
   meta_file << "Recording started at: " << start_time << " ms\n";
   meta_file << "Recording ended at: " << end_time << " ms\n";
   meta_file << "Duration: " << duration_ms << " ms\n";
-  meta_file << "Clients recorded: " << chunks_by_client.size() << "\n";
-
-  for (const auto &[client_id, chunks] : chunks_by_client) {
-    meta_file << "Client " << client_id << ": " << chunks.size() << " chunks\n";
+  meta_file << "Clients recorded: " << recording.tracks_by_client.size()
+            << "\n";
+
+  for (const auto &output : recording.files) {
+    for (const auto &track : output.tracks) {
+      meta_file << "Server " << track.client.first;
+      if (track.client.second == MIXED_PLAYBACK_CLIENT_ID) {
+        meta_file << " mixed playback";
+      } else {
+        meta_file << " client " << track.client.second;
+      }
+      meta_file << ": " << track.chunks << " chunks, "
+                << output.file->path().filename().string() << " channel "
+                << track.first_channel + 1;
+      if (track.channels > 1) {
+        meta_file << "-" << track.first_channel + track.channels;
+      }
+      meta_file << "\n";
+    }
   }
+  files.push_back(meta_file_path);
+  return files;
 }
 
 } // namespace zio
@@ -1,51 +1,191 @@
 #pragma once
 
 #include "audio_buffer.h"
-#include <fstream>
+#include "output_file.h"
 
 namespace zio {
 
 class FileWriter {
 public:
-  FileWriter();
+  // Outcome of one save, passed to its completion callback
+  struct SaveResult {
+    uint64_t ticket = 0;
+    bool success = false;
+    std::string error;
+    std::vector<std::filesystem::path> files; // empty if there was no audio
+    // From enqueue_save_task() until the files were closed
+    std::chrono::steady_clock::duration latency{};
+  };
+  // Chunks to save as separate streams, each in position order. A client
+  // may have several streams, e.g. audio recovered from an earlier session.
+  using ChunkStreams = std::vector<std::vector<AudioChunk>>;
+  // Extracts one stream; the extractors of a batch run in parallel on the
+  // writer pool, since extraction decodes the cold audio
+  using ChunkExtractor = std::function<std::vector<AudioChunk>()>;
+  // One round of audio for a save. A save that keeps recording after the
+  // trigger is fed in several batches, each continuing its client tracks;
+  // the source is called again at next_at until it returns the last one.
+  struct ChunkBatch {
+    std::vector<ChunkExtractor> streams;
+    // Every frame starting before this position is in this batch or an
+    // earlier one, so the tracks can be written up to it
+    uint64_t complete_until = UINT64_MAX;
+    bool last = true;
+    std::chrono::steady_clock::time_point next_at{};
+  };
+  using ChunkSource = std::function<ChunkBatch()>;
+  using SaveCallback = std::function<void(const SaveResult &)>;
+
+  explicit FileWriter(size_t thread_count = DEFAULT_WRITER_THREADS,
+                      OutputFile::Backend backend = OutputFile::Backend::Auto);
   ~FileWriter();
 
+  // stop() finishes the queued saves; a save still recording its post-roll
+  // is completed with the audio it has so far
   void start();
   void stop();
-  void enqueue_save_task(std::vector<AudioChunk> chunks,
-                         const std::filesystem::path &base_path);
+  // Returns a ticket identifying the save right away. The source runs on
+  // a writer thread, and on_complete, if given, is called there with the
+  // result once the files are written. Each batch is appended to the open
+  // files as it arrives, so a long save never holds all of its audio.
+  //
+  // Saves are started in the order they were enqueued and run
+  // concurrently; the batches of one save are processed one after the
+  // other, so its files are always appended in order. A save waiting for
+  // its next batch does not occupy a thread.
+  uint64_t enqueue_save_task(ChunkSource source,
+                             const std::filesystem::path &base_path,
+                             SaveCallback on_complete = nullptr);
+
+  // Keeps the files of saves started from now on out of the page cache
+  // (see OutputFile::create), so a large save does not evict the cache of
+  // everything else on the machine
+  void set_bypass_cache(bool bypass) {
+    bypass_cache_.store(bypass, std::memory_order_relaxed);
+  }
+  bool bypass_cache() const {
+    return bypass_cache_.load(std::memory_order_relaxed);
+  }
 
 private:
   void writer_thread();
 
-  struct SaveTask {
-    std::vector<AudioChunk> chunks;
-    std::filesystem::path base_path;
-  };
-
-  // WAV file format helpers
+  // WAV file format helpers. The format is WAVE_FORMAT_EXTENSIBLE, which
+  // files with more than two channels require. The header reserves room
+  // for an RF64 ds64 chunk (EBU Tech 3306): it stays a JUNK chunk readers
+  // skip unless the data outgrows the 32-bit RIFF sizes, in which case
+  // finish_recording() turns the file into RF64.
   struct WAVHeader {
-    char chunk_id[4] = {'R', 'I', 'F', 'F'};
-    uint32_t chunk_size;
+    char riff_id[4] = {'R', 'I', 'F', 'F'};
+    uint32_t riff_size;
     char format[4] = {'W', 'A', 'V', 'E'};
-    char subchunk1_id[4] = {'f', 'm', 't', ' '};
-    uint32_t subchunk1_size = 16;
-    uint16_t audio_format = 1; // PCM
+    char ds64_id[4] = {'J', 'U', 'N', 'K'};
+    uint32_t ds64_size = 28;
+    uint32_t riff_size_low = 0;
+    uint32_t riff_size_high = 0;
+    uint32_t data_size_low = 0;
+    uint32_t data_size_high = 0;
+    uint32_t sample_count_low = 0;
+    uint32_t sample_count_high = 0;
+    uint32_t table_length = 0;
+    char fmt_id[4] = {'f', 'm', 't', ' '};
+    uint32_t fmt_size = 40;
+    uint16_t audio_format = 0xFFFE; // WAVE_FORMAT_EXTENSIBLE
     uint16_t num_channels;
     uint32_t sample_rate;
     uint32_t byte_rate;
     uint16_t block_align;
     uint16_t bits_per_sample = 16;
-    char subchunk2_id[4] = {'d', 'a', 't', 'a'};
-    uint32_t subchunk2_size;
+    uint16_t extension_size = 22;
+    uint16_t valid_bits_per_sample = 16;
+    uint32_t channel_mask;
+    // KSDATAFORMAT_SUBTYPE_PCM
+    uint8_t sub_format[16] = {0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+                              0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71};
+    char data_id[4] = {'d', 'a', 't', 'a'};
+    uint32_t data_size;
+  };
+  static_assert(sizeof(WAVHeader) == 104);
+
+  // A client's channels in a multitrack file. Chunks past what has been
+  // written wait in pending until a later batch completes their span.
+  struct Track {
+    std::pair<ServerConnectionHandlerID, ClientID> client;
+    uint16_t channels;
+    uint16_t first_channel; // in the file's interleaved frames
+    std::deque<AudioChunk> pending;
+    size_t chunks = 0;
+    uint64_t end_position = 0;
+  };
+  // One interleaved WAV file holding the tracks of several clients. The
+  // header sizes are filled in when the recording is finished.
+  struct MultitrackFile {
+    std::unique_ptr<OutputFile> file;
+    WAVHeader header;
+    uint64_t data_bytes = 0;
+    std::vector<Track> tracks;
   };
+  // A save in progress. All files start at start_position and have been
+  // written up to written_position, so their tracks stay sample-aligned.
+  struct Recording {
+    std::filesystem::path base_path;
+    std::string timestamp_str;
+    bool bypass_cache = false;
+    bool started = false;
+    uint32_t sample_rate = 0;
+    uint64_t start_position = 0;
+    uint64_t written_position = 0;
+    std::deque<MultitrackFile> files; // tracks_by_client points into it
+    std::map<std::pair<ServerConnectionHandlerID, ClientID>, Track *>
+        tracks_by_client;
+  };
+
+  struct SaveTask {
+    uint64_t ticket;
+    ChunkSource source;
+    std::filesystem::path base_path;
+    SaveCallback on_complete;
+    std::chrono::steady_clock::time_point enqueued_at;
+    // Created on the first batch
+    std::unique_ptr<Recording> recording;
+    std::chrono::steady_clock::time_point next_at{};
+  };
+
+  // Processes the task's next batch; returns false if the task waits for
+  // another one, otherwise completes it and reports the result
+  bool run_save_task(SaveTask &task);
+  // Runs the extractors on the pool, helping with queued jobs meanwhile
+  ChunkStreams extract_streams(std::vector<ChunkExtractor> extractors);
 
-  void write_wav_file(const SaveTask &task);
-  void write_multitrack_wav(const SaveTask &task);
+  // Queues a batch on the recording's tracks and writes every file up to
+  // complete_until in one interleaving pass. Clients first seen after the
+  // files were started go to a new file aligned to the same start.
+  void write_multitrack_wav(Recording &recording, ChunkStreams streams,
+                            uint64_t complete_until);
+  void open_multitrack_file(
+      Recording &recording,
+      std::vector<std::pair<std::pair<ServerConnectionHandlerID, ClientID>,
+                            uint16_t>>
+          clients);
+  // Writes frames [written_position, until) of one file, filling gaps in
+  // its tracks with silence
+  void interleave_tracks(MultitrackFile &output, uint64_t from,
+                         uint64_t until);
+  // Completes the headers and writes the metadata file; returns the files
+  // written
+  std::vector<std::filesystem::path> finish_recording(Recording &recording);
 
+  const size_t thread_count_;
+  const OutputFile::Backend backend_;
+  std::atomic<bool> bypass_cache_{false};
   std::atomic<bool> running_{false};
-  std::thread writer_thread_;
+  std::atomic<uint64_t> next_ticket_{1};
+  std::vector<std::thread> writer_threads_;
+  // All guarded by queue_mutex_. Jobs are parts of a running save and are
+  // taken before any new save; waiting_tasks_ hold saves until next_at.
   std::queue<SaveTask> task_queue_;
+  std::vector<SaveTask> waiting_tasks_;
+  std::queue<std::function<void()>> job_queue_;
   std::mutex queue_mutex_;
   std::condition_variable queue_cv_;
 };
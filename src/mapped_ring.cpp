@@ -0,0 +1,337 @@
+#include "mapped_ring.h"
+#include <algorithm>
+#include <cstring>
+#include <ranges>
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace zio {
+
+struct MappedRing::Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t sample_rate;
+  uint64_t server_id;
+  uint32_t client_id;
+  uint32_t reserved;
+  uint64_t record_slots;
+  uint64_t sample_slots;
+  int64_t clock_offset_ms; // system_clock minus steady_clock at creation
+  // Only accessed through std::atomic_ref
+  uint64_t record_write;
+  uint64_t sample_write; // absolute sample position, like record numbers
+};
+
+struct MappedRing::Record {
+  uint64_t position;   // on the recorder timeline
+  uint64_t sample_pos; // absolute position in the sample ring
+  uint32_t sample_count;
+  uint32_t silent_samples;
+  uint16_t channels;
+};
+
+namespace {
+constexpr char MAGIC[8] = {'Z', 'I', 'O', 'R', 'I', 'N', 'G', '\0'};
+constexpr uint32_t VERSION = 2;
+// One record per 10 ms frame, as in AudioBuffer
+constexpr size_t RECORD_MS = 10;
+
+int64_t clock_offset_ms() {
+  auto wall = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch());
+  return wall.count() -
+         static_cast<int64_t>(
+             timestamp_to_ms(std::chrono::steady_clock::now()));
+}
+
+// Maps the whole file; a new file is created with the given size. Returns
+// nullptr on failure.
+void *map_file(const std::filesystem::path &path, size_t &size, bool create) {
+#ifdef _WIN32
+  HANDLE file = CreateFileW(
+      path.c_str(), create ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+      FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+      create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return nullptr;
+
+  if (!create) {
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+      CloseHandle(file);
+      return nullptr;
+    }
+    size = static_cast<size_t>(file_size.QuadPart);
+  }
+
+  // Mapping a new file with an explicit size also extends it
+  uint64_t map_size = create ? size : 0;
+  HANDLE mapping = CreateFileMappingW(
+      file, nullptr, create ? PAGE_READWRITE : PAGE_READONLY,
+      static_cast<DWORD>(map_size >> 32), static_cast<DWORD>(map_size),
+      nullptr);
+  CloseHandle(file);
+  if (!mapping)
+    return nullptr;
+
+  void *base = MapViewOfFile(mapping, create ? FILE_MAP_WRITE : FILE_MAP_READ,
+                             0, 0, size);
+  CloseHandle(mapping);
+  return base;
+#else
+  int fd = ::open(path.c_str(),
+                  create ? O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC
+                         : O_RDONLY | O_CLOEXEC,
+                  0644);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat st {};
+  bool sized = create ? ::ftruncate(fd, static_cast<off_t>(size)) == 0
+                      : ::fstat(fd, &st) == 0 && st.st_size > 0;
+  if (!sized) {
+    ::close(fd);
+    return nullptr;
+  }
+  if (!create) {
+    size = static_cast<size_t>(st.st_size);
+  }
+
+  void *base = ::mmap(nullptr, size, create ? PROT_READ | PROT_WRITE : PROT_READ,
+                      MAP_SHARED, fd, 0);
+  ::close(fd);
+  return base == MAP_FAILED ? nullptr : base;
+#endif
+}
+
+void unmap_file(void *base, size_t size) {
+#ifdef _WIN32
+  UnmapViewOfFile(base);
+#else
+  ::munmap(base, size);
+#endif
+}
+} // namespace
+
+MappedRing::MappedRing(std::filesystem::path path, void *base, size_t size)
+    : path_(std::move(path)), base_(base), size_(size),
+      header_(static_cast<Header *>(base)),
+      records_(reinterpret_cast<Record *>(header_ + 1)),
+      samples_(nullptr) {}
+
+MappedRing::~MappedRing() { unmap_file(base_, size_); }
+
+std::shared_ptr<MappedRing>
+MappedRing::create(const std::filesystem::path &path, uint32_t sample_rate,
+                   size_t capacity_ms, ClientID client_id,
+                   ServerConnectionHandlerID server_id) {
+  uint64_t record_slots = capacity_ms / RECORD_MS + 2;
+  uint64_t sample_slots =
+      std::max<uint64_t>(uint64_t{capacity_ms} * sample_rate / 1000, 1);
+  size_t size = sizeof(Header) + record_slots * sizeof(Record) +
+                sample_slots * sizeof(int16_t);
+
+  void *base = map_file(path, size, true);
+  if (!base) {
+    throw std::runtime_error("Cannot map ring file: " + path.string());
+  }
+  std::shared_ptr<MappedRing> ring(new MappedRing(path, base, size));
+
+  // The file starts out zeroed; write the magic last so a half-initialized
+  // file is never taken for a ring
+  Header &header = *ring->header_;
+  header.version = VERSION;
+  header.sample_rate = sample_rate;
+  header.server_id = server_id;
+  header.client_id = client_id;
+  header.record_slots = record_slots;
+  header.sample_slots = sample_slots;
+  header.clock_offset_ms = clock_offset_ms();
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+
+  ring->samples_ = reinterpret_cast<int16_t *>(ring->records_ + record_slots);
+  return ring;
+}
+
+std::shared_ptr<MappedRing>
+MappedRing::open(const std::filesystem::path &path) {
+  size_t size = 0;
+  void *base = map_file(path, size, false);
+  if (!base)
+    return nullptr;
+  std::shared_ptr<MappedRing> ring(new MappedRing(path, base, size));
+
+  const Header &header = *ring->header_;
+  if (size < sizeof(Header) ||
+      std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.version != VERSION || header.record_slots < 2 ||
+      header.sample_slots == 0 || header.sample_rate == 0 ||
+      header.record_slots > size / sizeof(Record) ||
+      header.sample_slots > size / sizeof(int16_t) ||
+      size != sizeof(Header) + header.record_slots * sizeof(Record) +
+                  header.sample_slots * sizeof(int16_t))
+    return nullptr;
+
+  ring->samples_ =
+      reinterpret_cast<int16_t *>(ring->records_ + header.record_slots);
+  ring->position_shift_ = (header.clock_offset_ms - clock_offset_ms()) *
+                         static_cast<int64_t>(header.sample_rate) / 1000;
+  return ring;
+}
+
+void MappedRing::set_owner(ClientID client_id,
+                           ServerConnectionHandlerID server_id) {
+  header_->client_id = client_id;
+  header_->server_id = server_id;
+}
+
+void MappedRing::clear() {
+  // Drop the records first, so a crash in between leaves an empty ring
+  // rather than records pointing at reclaimed samples
+  std::atomic_ref<uint64_t>(header_->record_write)
+      .store(0, std::memory_order_release);
+  std::atomic_ref<uint64_t>(header_->sample_write)
+      .store(0, std::memory_order_release);
+}
+
+void MappedRing::append(std::span<const int16_t> samples,
+                        uint64_t position, uint16_t channels) {
+  uint64_t slots = header_->sample_slots;
+  if (samples.size() > slots) {
+    samples = samples.last(slots);
+  }
+
+  // Keep every frame contiguous in the file
+  std::atomic_ref<uint64_t> sample_write(header_->sample_write);
+  uint64_t pos = sample_write.load(std::memory_order_relaxed);
+  if (pos % slots + samples.size() > slots) {
+    pos += slots - pos % slots;
+  }
+
+  // Claim the space before overwriting it, so that after a crash in the
+  // middle of the copy the records of the old samples are already invalid
+  sample_write.store(pos + samples.size(), std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(samples_ + pos % slots, samples.data(),
+              samples.size() * sizeof(int16_t));
+
+  publish({position, pos, static_cast<uint32_t>(samples.size()), 0,
+           channels});
+}
+
+void MappedRing::append_silence(uint32_t samples, uint64_t position,
+                                uint16_t channels) {
+  uint64_t pos = std::atomic_ref<uint64_t>(header_->sample_write)
+                     .load(std::memory_order_relaxed);
+  publish({position, pos, 0, samples, channels});
+}
+
+void MappedRing::publish(const Record &record) {
+  std::atomic_ref<uint64_t> record_write(header_->record_write);
+  uint64_t index = record_write.load(std::memory_order_relaxed);
+  records_[index % header_->record_slots] = record;
+  record_write.store(index + 1, std::memory_order_release);
+}
+
+const MappedRing::Record &MappedRing::record_at(uint64_t index) const {
+  return records_[index % header_->record_slots];
+}
+
+std::pair<uint64_t, uint64_t> MappedRing::valid_records() const {
+  uint64_t end = std::atomic_ref<uint64_t>(header_->record_write)
+                     .load(std::memory_order_acquire);
+  uint64_t sample_end = std::atomic_ref<uint64_t>(header_->sample_write)
+                            .load(std::memory_order_acquire);
+
+  // The slot after the newest record may have been half rewritten when the
+  // writer stopped, so one slot less than the ring holds is trustworthy
+  uint64_t slots = header_->record_slots - 1;
+  uint64_t begin = end > slots ? end - slots : 0;
+
+  // Records are in sample order; skip the ones whose samples were reused
+  uint64_t sample_begin = sample_end > header_->sample_slots
+                              ? sample_end - header_->sample_slots
+                              : 0;
+  auto record_numbers = std::views::iota(begin, end);
+  auto it = std::ranges::partition_point(record_numbers, [&](uint64_t i) {
+    return record_at(i).sample_pos < sample_begin;
+  });
+  return {it == record_numbers.end() ? end : *it, end};
+}
+
+std::vector<AudioChunk> MappedRing::extract(uint64_t from_position,
+                                            uint64_t until_position) {
+  std::vector<AudioChunk> result;
+  auto [begin, end] = valid_records();
+
+  // Search on the stored clock
+  auto to_stored = [this](uint64_t position) {
+    int64_t stored = static_cast<int64_t>(position) - position_shift_;
+    return stored < 0 ? uint64_t{0} : static_cast<uint64_t>(stored);
+  };
+  uint64_t from = to_stored(from_position);
+  uint64_t until =
+      until_position == UINT64_MAX ? UINT64_MAX : to_stored(until_position);
+
+  auto record_numbers = std::views::iota(begin, end);
+  auto first = std::ranges::partition_point(record_numbers, [&](uint64_t i) {
+    return record_at(i).position < from;
+  });
+  auto last = std::ranges::partition_point(record_numbers, [&](uint64_t i) {
+    return record_at(i).position < until;
+  });
+
+  uint64_t slots = header_->sample_slots;
+  std::shared_ptr<const int16_t[]> storage(shared_from_this(), samples_);
+  for (auto it = first; it < last; ++it) {
+    Record record = record_at(*it);
+    if (record.sample_pos % slots + record.sample_count > slots)
+      continue; // not written by us
+
+    result.push_back(
+        {{},
+         storage,
+         std::span<const int16_t>(samples_ + record.sample_pos % slots,
+                                  record.sample_count),
+         record.silent_samples,
+         to_local(record.position),
+         static_cast<ClientID>(header_->client_id),
+         header_->server_id,
+         header_->sample_rate,
+         record.channels});
+  }
+  return result;
+}
+
+uint64_t MappedRing::newest_position() const {
+  auto [begin, end] = valid_records();
+  if (begin == end)
+    return 0;
+  return to_local(record_at(end - 1).position);
+}
+
+ServerConnectionHandlerID MappedRing::server_id() const {
+  return header_->server_id;
+}
+
+uint64_t MappedRing::to_local(uint64_t stored_position) const {
+  int64_t local = static_cast<int64_t>(stored_position) + position_shift_;
+  return local < 0 ? 0 : static_cast<uint64_t>(local);
+}
+
+} // namespace zio
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "audio_chunk.h"
+#include "zio_includes.h"
+
+namespace zio {
+
+// Crash-safe copy of one client's recent audio in a memory-mapped file.
+//
+// While recording, the owning AudioBuffer mirrors the frames it publishes
+// into the ring from the maintenance thread, a few tens of milliseconds
+// behind the audio thread, which never touches the mapping: samples go to a
+// sample ring and a small record per frame to a record ring, and the
+// header's write indices are advanced only after the data they cover is
+// complete. If the process dies, the file holds a consistent ring up to
+// the last mirrored frame, and open() maps it again without reading or
+// copying anything. The kernel is free to page out the
+// part of the ring nobody touches.
+//
+// Frames are stored with their RecorderClock positions, which count from
+// the steady_clock epoch; the header keeps the wall clock offset so a
+// recovered ring can be placed on the timeline of the process that opens
+// it, even after a reboot.
+class MappedRing : public std::enable_shared_from_this<MappedRing> {
+public:
+  // Creates the ring file, replacing any existing one. Throws
+  // std::runtime_error if the file cannot be created or mapped.
+  static std::shared_ptr<MappedRing>
+  create(const std::filesystem::path &path, uint32_t sample_rate,
+         size_t capacity_ms, ClientID client_id,
+         ServerConnectionHandlerID server_id);
+  // Maps a ring left by an earlier session read-only; returns nullptr if
+  // the file is not a valid ring
+  static std::shared_ptr<MappedRing> open(const std::filesystem::path &path);
+
+  ~MappedRing();
+
+  MappedRing(const MappedRing &) = delete;
+  MappedRing &operator=(const MappedRing &) = delete;
+
+  // Producer side, called from the one thread that mirrors the
+  // AudioBuffer. A ring created ahead of its client is assigned to it with
+  // set_owner() before the first append.
+  void set_owner(ClientID client_id, ServerConnectionHandlerID server_id);
+  // Empties the ring before it is reused for another client
+  void clear();
+  void append(std::span<const int16_t> samples, uint64_t position,
+              uint16_t channels);
+  void append_silence(uint32_t samples, uint64_t position,
+                      uint16_t channels);
+
+  // Recovered side: frames starting in [from_position, until_position), as
+  // views into the mapping that keep the ring alive
+  std::vector<AudioChunk> extract(uint64_t from_position,
+                                  uint64_t until_position);
+  // Position of the newest recovered frame, or 0 if the ring is empty
+  uint64_t newest_position() const;
+
+  ServerConnectionHandlerID server_id() const;
+  const std::filesystem::path &path() const { return path_; }
+  size_t mapped_bytes() const { return size_; }
+
+private:
+  struct Header;
+  struct Record;
+
+  MappedRing(std::filesystem::path path, void *base, size_t size);
+
+  void publish(const Record &record);
+  // Recorded frames still intact, as [first, end) record numbers
+  std::pair<uint64_t, uint64_t> valid_records() const;
+  const Record &record_at(uint64_t index) const;
+  uint64_t to_local(uint64_t stored_position) const;
+
+  std::filesystem::path path_;
+  void *base_;
+  size_t size_;
+
+  Header *header_;
+  Record *records_;
+  int16_t *samples_;
+
+  // Added to stored positions to move them onto this process's clock
+  int64_t position_shift_ = 0;
+};
+
+} // namespace zio
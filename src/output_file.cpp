@@ -0,0 +1,613 @@
+#include "output_file.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define ZIO_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#endif
+#endif
+#endif
+
+namespace zio {
+
+namespace {
+// Size of one staging buffer, i.e. of one write request
+constexpr size_t STAGING_BUFFER_BYTES = 1 << 20;
+
+#ifdef _WIN32
+class StreamOutputFile final : public OutputFile {
+public:
+  // Writes always go through the page cache here
+  StreamOutputFile(const std::filesystem::path &path, bool /*bypass_cache*/)
+      : OutputFile(path), file_(path, std::ios::binary),
+        buffer_(STAGING_BUFFER_BYTES) {
+    if (!file_)
+      fail("Cannot open file for writing");
+  }
+
+  std::span<char> next_buffer() override { return buffer_; }
+
+  void append(size_t bytes) override {
+    file_.write(buffer_.data(), bytes);
+    if (!file_)
+      fail("Cannot write file");
+  }
+
+  void write_at(uint64_t offset, std::span<const char> data) override {
+    file_.seekp(offset);
+    file_.write(data.data(), data.size());
+    file_.seekp(0, std::ios::end);
+    if (!file_)
+      fail("Cannot write file");
+  }
+
+  void close() override {
+    file_.close();
+    if (!file_)
+      fail("Cannot write file");
+  }
+
+private:
+  std::ofstream file_;
+  std::vector<char> buffer_;
+};
+#else
+// Writes all of the buffers at offset; returns 0 or an errno value
+int write_fully(int fd, iovec *iov, int count, uint64_t offset) {
+  while (count > 0) {
+    ssize_t written = ::pwritev(fd, iov, count, static_cast<off_t>(offset));
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    offset += static_cast<uint64_t>(written);
+    // Skip what was written and continue within a partly written buffer
+    auto rest = static_cast<size_t>(written);
+    while (count > 0 && rest >= iov->iov_len) {
+      rest -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + rest;
+      iov->iov_len -= rest;
+    }
+  }
+  return 0;
+}
+
+int write_fully(int fd, const char *data, size_t size, uint64_t offset) {
+  iovec iov{const_cast<char *>(data), size};
+  return write_fully(fd, &iov, 1, offset);
+}
+
+// Allocates the file's blocks up to size in one request, without changing
+// its size. Best effort: where fallocate is missing the filesystem
+// allocates as the data is written.
+void preallocate(int fd, uint64_t from, uint64_t size) {
+#ifdef __linux__
+  ::fallocate(fd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(from),
+              static_cast<off_t>(size - from));
+#else
+  (void)fd;
+  (void)from;
+  (void)size;
+#endif
+}
+
+// Page-aligned staging buffers; the alignment lets the kernel copy (or
+// map) whole pages
+char *allocate_staging_buffers(unsigned count) {
+  return static_cast<char *>(
+      std::aligned_alloc(4096, count * STAGING_BUFFER_BYTES));
+}
+
+// Alignment of the offsets, lengths and buffers of direct writes; covers
+// the logical block size of common disks
+constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+
+// Opens a file and, if asked to, keeps it out of the page cache. The file
+// is opened with O_DIRECT where the filesystem allows it (tmpfs, for one,
+// does not). Direct writes must cover whole aligned blocks, so the bytes of
+// an append past the last whole block are carried to the start of the next
+// buffer. Once the appends are done the carried tail and any overwrites
+// go through the page cache, and the file's cached pages are dropped when
+// it is closed; without O_DIRECT that is all there is.
+class CacheBypass {
+public:
+  explicit CacheBypass(bool enabled) : enabled_(enabled) {}
+
+  // Creates or truncates the file; throws std::runtime_error on failure
+  int open(const std::filesystem::path &path) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+#ifdef O_DIRECT
+    if (enabled_) {
+      int fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+      if (fd >= 0) {
+        direct_ = true;
+        return fd;
+      }
+    }
+#endif
+    int fd = ::open(path.c_str(), flags, 0644);
+    if (fd < 0) {
+      throw std::runtime_error("Cannot open file for writing: " +
+                               path.string());
+    }
+    return fd;
+  }
+
+  size_t carried() const { return carried_; }
+
+  // Puts the carried bytes at the start of buffer; returns their count
+  size_t restore(char *buffer) const {
+    std::memcpy(buffer, carry_.data(), carried_);
+    return carried_;
+  }
+
+  // Given a buffer filled with bytes, including the restored ones, returns
+  // how many of them to write now and carries the rest
+  size_t take(const char *buffer, size_t bytes) {
+    if (!direct_)
+      return bytes;
+    size_t whole = bytes - bytes % DIRECT_IO_ALIGNMENT;
+    carried_ = bytes - whole;
+    std::memcpy(carry_.data(), buffer + whole, carried_);
+    return whole;
+  }
+
+  // Ends direct writes once the aligned appends have completed: writes the
+  // carried tail at offset, which it advances. Returns 0 or an errno value.
+  int end_direct(int fd, uint64_t &offset) {
+    if (!direct_)
+      return 0;
+    direct_ = false;
+#ifdef O_DIRECT
+    int flags = ::fcntl(fd, F_GETFL);
+    if (flags < 0 || ::fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0)
+      return errno;
+#endif
+    int error = write_fully(fd, carry_.data(), carried_, offset);
+    offset += carried_;
+    carried_ = 0;
+    return error;
+  }
+
+  // Called when all writes are done; only clean pages can be dropped, so
+  // the file is written back first
+  void drop_cache(int fd) const {
+    if (!enabled_)
+      return;
+#ifdef POSIX_FADV_DONTNEED
+    ::fdatasync(fd);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+    (void)fd;
+#endif
+  }
+
+private:
+  bool enabled_;
+  bool direct_ = false;
+  std::array<char, DIRECT_IO_ALIGNMENT> carry_;
+  size_t carried_ = 0;
+};
+
+// Buffers filled before they are written together
+constexpr unsigned STREAM_BUFFERS = 4;
+
+class StreamOutputFile final : public OutputFile {
+public:
+  StreamOutputFile(const std::filesystem::path &path, bool bypass_cache)
+      : OutputFile(path), bypass_(bypass_cache), fd_(bypass_.open(path)),
+        storage_(allocate_staging_buffers(STREAM_BUFFERS)) {
+    if (!storage_) {
+      ::close(fd_);
+      throw std::bad_alloc();
+    }
+  }
+
+  ~StreamOutputFile() override {
+    if (fd_ >= 0)
+      ::close(fd_);
+    std::free(storage_);
+  }
+
+  std::span<char> next_buffer() override {
+    if (staged_ == STREAM_BUFFERS)
+      flush();
+    char *buffer = storage_ + staged_ * STAGING_BUFFER_BYTES;
+    size_t carried = bypass_.restore(buffer);
+    return {buffer + carried, STAGING_BUFFER_BYTES - carried};
+  }
+
+  void append(size_t bytes) override {
+    char *buffer = storage_ + staged_ * STAGING_BUFFER_BYTES;
+    size_t ready = bypass_.take(buffer, bypass_.carried() + bytes);
+    // A buffer holding less than a block is filled further next time
+    if (ready > 0)
+      iovecs_[staged_++] = {buffer, ready};
+  }
+
+  void reserve(uint64_t size) override {
+    if (size <= reserved_)
+      return;
+    preallocate(fd_, reserved_, size);
+    reserved_ = size;
+  }
+
+  void write_at(uint64_t offset, std::span<const char> data) override {
+    flush();
+    end_direct();
+    if (int error = write_fully(fd_, data.data(), data.size(), offset))
+      fail(std::format("Cannot write file ({})", std::strerror(error)));
+  }
+
+  void close() override {
+    flush();
+    end_direct();
+    bypass_.drop_cache(fd_);
+    int fd = std::exchange(fd_, -1);
+    if (::close(fd) != 0)
+      fail("Cannot write file");
+  }
+
+private:
+  // Writes the staged buffers with a single system call where possible
+  void flush() {
+    if (staged_ == 0)
+      return;
+    uint64_t bytes = 0;
+    for (unsigned i = 0; i < staged_; ++i) {
+      bytes += iovecs_[i].iov_len;
+    }
+    int error = write_fully(fd_, iovecs_.data(), static_cast<int>(staged_),
+                            append_offset_);
+    staged_ = 0;
+    append_offset_ += bytes;
+    if (error)
+      fail(std::format("Cannot write file ({})", std::strerror(error)));
+  }
+
+  void end_direct() {
+    if (int error = bypass_.end_direct(fd_, append_offset_))
+      fail(std::format("Cannot write file ({})", std::strerror(error)));
+  }
+
+  CacheBypass bypass_;
+  int fd_;
+  char *storage_;
+  std::array<iovec, STREAM_BUFFERS> iovecs_{};
+  unsigned staged_ = 0;
+  uint64_t append_offset_ = 0;
+  uint64_t reserved_ = 0;
+};
+#endif
+
+#ifdef ZIO_HAVE_IO_URING
+// Buffers in flight at once; the submission queue never holds more
+constexpr unsigned URING_BUFFERS = 4;
+constexpr unsigned URING_ENTRIES = 8;
+
+int io_uring_setup(unsigned entries, io_uring_params *params) {
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags) {
+  int ret;
+  do {
+    ret = static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                                     min_complete, flags, nullptr, 0));
+  } while (ret < 0 && errno == EINTR);
+  return ret;
+}
+
+int io_uring_register(int ring_fd, unsigned opcode, const void *arg,
+                      unsigned count) {
+  return static_cast<int>(
+      ::syscall(__NR_io_uring_register, ring_fd, opcode, arg, count));
+}
+
+class UringOutputFile final : public OutputFile {
+public:
+  // Returns nullptr if the kernel does not offer io_uring to us
+  static std::unique_ptr<UringOutputFile>
+  create(const std::filesystem::path &path, bool bypass_cache) {
+    std::unique_ptr<UringOutputFile> file(
+        new UringOutputFile(path, bypass_cache));
+    if (!file->init_ring())
+      return nullptr;
+    return file;
+  }
+
+  ~UringOutputFile() override {
+    // The kernel may still be reading our buffers
+    if (ring_fd_ >= 0) {
+      while (in_flight_ > 0 && reap(in_flight_)) {
+      }
+    }
+    if (sqes_)
+      ::munmap(sqes_, sqes_size_);
+    if (cq_ring_ && cq_ring_ != sq_ring_)
+      ::munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_)
+      ::munmap(sq_ring_, sq_ring_size_);
+    if (ring_fd_ >= 0)
+      ::close(ring_fd_);
+    if (fd_ >= 0)
+      ::close(fd_);
+    std::free(storage_);
+  }
+
+  std::span<char> next_buffer() override {
+    // Buffers are submitted in turn, so the next one is the oldest in
+    // flight; wait for it only if the kernel is still writing it
+    while (buffers_[current_].in_flight) {
+      if (!reap(1))
+        fail("Cannot wait for writes");
+    }
+    throw_if_failed();
+    char *data = buffers_[current_].data;
+    size_t carried = bypass_.restore(data);
+    return {data + carried, STAGING_BUFFER_BYTES - carried};
+  }
+
+  void append(size_t bytes) override {
+    Buffer &buffer = buffers_[current_];
+    bytes = bypass_.take(buffer.data, bypass_.carried() + bytes);
+    // A buffer holding less than a block is filled further next time
+    if (bytes == 0)
+      return;
+    buffer.bytes = bytes;
+    buffer.offset = append_offset_;
+    append_offset_ += bytes;
+    submit(current_);
+    current_ = (current_ + 1) % URING_BUFFERS;
+  }
+
+  void reserve(uint64_t size) override {
+    if (size <= reserved_)
+      return;
+    preallocate(fd_, reserved_, size);
+    reserved_ = size;
+  }
+
+  void write_at(uint64_t offset, std::span<const char> data) override {
+    drain();
+    end_direct();
+    if (int error = write_fully(fd_, data.data(), data.size(), offset)) {
+      fail(std::format("Cannot write file ({})", std::strerror(error)));
+    }
+  }
+
+  void close() override {
+    drain();
+    end_direct();
+    bypass_.drop_cache(fd_);
+    int fd = std::exchange(fd_, -1);
+    if (::close(fd) != 0)
+      fail("Cannot write file");
+  }
+
+private:
+  struct Buffer {
+    char *data = nullptr;
+    size_t bytes = 0;
+    uint64_t offset = 0;
+    bool in_flight = false;
+  };
+
+  UringOutputFile(const std::filesystem::path &path, bool bypass_cache)
+      : OutputFile(path), bypass_(bypass_cache), fd_(bypass_.open(path)) {}
+
+  bool init_ring() {
+    io_uring_params params{};
+    ring_fd_ = io_uring_setup(URING_ENTRIES, &params);
+    if (ring_fd_ < 0)
+      return false;
+
+    sq_ring_size_ =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+    sq_ring_ = map_ring(sq_ring_size_, IORING_OFF_SQ_RING);
+    cq_ring_ =
+        single_mmap ? sq_ring_ : map_ring(cq_ring_size_, IORING_OFF_CQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe *>(map_ring(sqes_size_, IORING_OFF_SQES));
+    if (!sq_ring_ || !cq_ring_ || !sqes_)
+      return false;
+
+    auto *sq = static_cast<char *>(sq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    auto *cq = static_cast<char *>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    // Staging buffers are registered once so the kernel does not map them
+    // for every write. Registration can fail under a low memlock limit;
+    // plain writes from the same buffers work regardless.
+    storage_ = allocate_staging_buffers(URING_BUFFERS);
+    if (!storage_)
+      return false;
+    iovec iovecs[URING_BUFFERS];
+    for (unsigned i = 0; i < URING_BUFFERS; ++i) {
+      buffers_[i].data = storage_ + i * STAGING_BUFFER_BYTES;
+      iovecs[i] = {buffers_[i].data, STAGING_BUFFER_BYTES};
+    }
+    fixed_buffers_ = io_uring_register(ring_fd_, IORING_REGISTER_BUFFERS,
+                                       iovecs, URING_BUFFERS) == 0;
+    return true;
+  }
+
+  void *map_ring(size_t size, off_t offset) {
+    void *ring = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring_fd_, offset);
+    return ring == MAP_FAILED ? nullptr : ring;
+  }
+
+  void submit(unsigned index) {
+    Buffer &buffer = buffers_[index];
+    std::atomic_ref<unsigned> sq_tail(*sq_tail_);
+    unsigned tail = sq_tail.load(std::memory_order_relaxed);
+    unsigned slot = tail & sq_mask_;
+
+    io_uring_sqe &sqe = sqes_[slot];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = fixed_buffers_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe.fd = fd_;
+    sqe.off = buffer.offset;
+    sqe.addr = reinterpret_cast<uintptr_t>(buffer.data);
+    sqe.len = static_cast<uint32_t>(buffer.bytes);
+    sqe.buf_index = static_cast<uint16_t>(index);
+    sqe.user_data = index;
+    sq_array_[slot] = slot;
+    sq_tail.store(tail + 1, std::memory_order_release);
+
+    if (io_uring_enter(ring_fd_, 1, 0, 0) != 1) {
+      // Not consumed by the kernel: take the entry back and write the
+      // buffer ourselves so the file stays complete
+      if (int error = write_fully(fd_, buffer.data, buffer.bytes,
+                                  buffer.offset))
+        error_ = error;
+      sq_tail.store(tail, std::memory_order_release);
+      return;
+    }
+    buffer.in_flight = true;
+    ++in_flight_;
+  }
+
+  // Handles at least min_complete completions, waiting for them if needed;
+  // returns false if waiting failed
+  bool reap(unsigned min_complete) {
+    unsigned reaped = 0;
+    while (true) {
+      std::atomic_ref<unsigned> cq_head(*cq_head_);
+      unsigned head = cq_head.load(std::memory_order_relaxed);
+      unsigned tail =
+          std::atomic_ref<unsigned>(*cq_tail_).load(std::memory_order_acquire);
+      for (; head != tail; ++head, ++reaped) {
+        const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+        complete(static_cast<unsigned>(cqe.user_data), cqe.res);
+      }
+      cq_head.store(head, std::memory_order_release);
+
+      if (reaped >= min_complete)
+        return true;
+      if (io_uring_enter(ring_fd_, 0, min_complete - reaped,
+                         IORING_ENTER_GETEVENTS) < 0)
+        return false;
+    }
+  }
+
+  void complete(unsigned index, int result) {
+    Buffer &buffer = buffers_[index];
+    buffer.in_flight = false;
+    --in_flight_;
+    if (result < 0) {
+      error_ = -result;
+    } else if (static_cast<size_t>(result) < buffer.bytes) {
+      // Short write, e.g. interrupted by a signal: finish it directly
+      size_t done = static_cast<size_t>(result);
+      if (int error = write_fully(fd_, buffer.data + done, buffer.bytes - done,
+                                  buffer.offset + done))
+        error_ = error;
+    }
+  }
+
+  void drain() {
+    while (in_flight_ > 0) {
+      if (!reap(in_flight_))
+        fail("Cannot wait for writes");
+    }
+    throw_if_failed();
+  }
+
+  void throw_if_failed() const {
+    if (error_ != 0)
+      fail(std::format("Cannot write file ({})", std::strerror(error_)));
+  }
+
+  void end_direct() {
+    if (int error = bypass_.end_direct(fd_, append_offset_))
+      fail(std::format("Cannot write file ({})", std::strerror(error)));
+  }
+
+  CacheBypass bypass_;
+  int fd_;
+  int ring_fd_ = -1;
+  void *sq_ring_ = nullptr;
+  void *cq_ring_ = nullptr;
+  size_t sq_ring_size_ = 0;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe *sqes_ = nullptr;
+  size_t sqes_size_ = 0;
+  unsigned *sq_tail_ = nullptr;
+  unsigned *sq_array_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe *cqes_ = nullptr;
+
+  char *storage_ = nullptr;
+  std::array<Buffer, URING_BUFFERS> buffers_{};
+  bool fixed_buffers_ = false;
+  unsigned current_ = 0;
+  unsigned in_flight_ = 0;
+  uint64_t append_offset_ = 0;
+  uint64_t reserved_ = 0;
+  int error_ = 0; // errno of the first failed write
+};
+#endif
+} // namespace
+
+void OutputFile::fail(const std::string &what) const {
+  throw std::runtime_error(what + ": " + path_.string());
+}
+
+std::unique_ptr<OutputFile>
+OutputFile::create(const std::filesystem::path &path, Backend backend,
+                   bool bypass_cache) {
+#ifdef ZIO_HAVE_IO_URING
+  if (backend != Backend::Stream) {
+    if (auto file = UringOutputFile::create(path, bypass_cache))
+      return file;
+    if (backend == Backend::IoUring) {
+      static std::once_flag warned;
+      std::call_once(warned, [] {
+        std::cerr << "io_uring is not available, writing saves with streams"
+                  << std::endl;
+      });
+    }
+  }
+#endif
+  return std::make_unique<StreamOutputFile>(path, bypass_cache);
+}
+
+} // namespace zio
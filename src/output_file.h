@@ -0,0 +1,72 @@
+#pragma once
+
+#include "zio_includes.h"
+
+namespace zio {
+
+// Sequential output file for saves, with a choice of I/O backend.
+//
+// The writer fills staging buffers handed out by next_buffer() and appends
+// them whole, so a file is written in a few large requests instead of one
+// per audio chunk. With the io_uring backend the buffers are registered
+// with the kernel once and each append is submitted asynchronously: the
+// writer fills the next buffer while the previous ones are being written,
+// and only waits when every buffer is in flight. The stream backend writes
+// synchronously and works everywhere; on POSIX systems it stages several
+// buffers and writes them with a single pwritev.
+//
+// Not thread-safe; a file is written by one save at a time.
+class OutputFile {
+public:
+  enum class Backend {
+    Stream,
+    IoUring,
+    // io_uring where the kernel allows it, otherwise Stream
+    Auto,
+  };
+
+  // Creates or truncates the file. Throws std::runtime_error if it cannot
+  // be opened; an unavailable io_uring falls back to the stream backend.
+  //
+  // With bypass_cache the file is kept out of the page cache, for saves
+  // that will not be read back soon: it is written with O_DIRECT from the
+  // aligned staging buffers where the filesystem supports that, and its
+  // cached pages are dropped when it is closed. Not supported on Windows.
+  static std::unique_ptr<OutputFile> create(const std::filesystem::path &path,
+                                            Backend backend,
+                                            bool bypass_cache = false);
+
+  virtual ~OutputFile() = default;
+
+  OutputFile(const OutputFile &) = delete;
+  OutputFile &operator=(const OutputFile &) = delete;
+
+  // Buffer to fill for the next append(); valid until then
+  virtual std::span<char> next_buffer() = 0;
+  // Appends the first bytes of the buffer from next_buffer() at the end
+  // of the file. Errors of asynchronous writes are thrown by a later call.
+  virtual void append(size_t bytes) = 0;
+  // Hint that the file will grow to size bytes. Where the filesystem
+  // supports it the space is allocated at once, so the file gets a few
+  // large extents instead of growing block by block; the file size itself
+  // still only grows with the appends.
+  virtual void reserve(uint64_t /*size*/) {}
+  // Overwrites data already appended, e.g. to complete a header, once the
+  // earlier appends have finished
+  virtual void write_at(uint64_t offset, std::span<const char> data) = 0;
+  // Waits for all writes and closes the file; throws std::runtime_error if
+  // any of them failed
+  virtual void close() = 0;
+
+  const std::filesystem::path &path() const { return path_; }
+
+protected:
+  explicit OutputFile(std::filesystem::path path) : path_(std::move(path)) {}
+
+  [[noreturn]] void fail(const std::string &what) const;
+
+private:
+  std::filesystem::path path_;
+};
+
+} // namespace zio
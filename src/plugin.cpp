@@ -1,14 +1,20 @@
 #include "audio_recorder.h"
 #include "zio_includes.h"
 
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 
-static struct TS3Functions ts3Functions;
+struct TS3Functions ts3Functions;
 static std::unique_ptr<zio::AudioRecorder> audio_recorder;
+// 崩溃恢复的环形文件目录，位于TeamSpeak配置目录下
+static std::filesystem::path ring_dir;
 
 // 插件命令处理
-static void handle_command(const char *command);
+static void handle_command(uint64 serverConnectionHandlerID,
+                           const char *command);
 
 // TeamSpeak插件必需的回调函数
 extern "C" {
@@ -23,6 +29,27 @@ const char *ts3plugin_description() {
 int ts3plugin_init() {
   std::cout << "ZIO Voice Recorder plugin initializing..." << std::endl;
   audio_recorder = std::make_unique<zio::AudioRecorder>();
+
+  // 持久化默认关闭（!ziopersist on开启）；之前开启时留下的文件
+  // 总是重新挂载，客户端崩溃或插件重载后可用!ziorecover保存
+  char config_path[1024] = {};
+  ts3Functions.getConfigPath(config_path, sizeof(config_path));
+  ring_dir = std::filesystem::path(config_path) / "zio_rings";
+  audio_recorder->recover_rings(ring_dir);
+
+  // 插件加载时已经建立的连接也开始记录
+  uint64 *handlers = nullptr;
+  if (ts3Functions.getServerConnectionHandlerList(&handlers) == ERROR_ok &&
+      handlers) {
+    for (int i = 0; handlers[i] != 0; i++) {
+      int status = STATUS_DISCONNECTED;
+      if (ts3Functions.getConnectionStatus(handlers[i], &status) == ERROR_ok &&
+          status == STATUS_CONNECTION_ESTABLISHED) {
+        audio_recorder->on_connect_status_change(handlers[i], status);
+      }
+    }
+    ts3Functions.freeMemory(handlers);
+  }
   return 0;
 }
 
@@ -49,7 +76,7 @@ int ts3plugin_requestAutoload() {
 // 插件命令处理
 int ts3plugin_processCommand(uint64 serverConnectionHandlerID,
                              const char *command) {
-  handle_command(command);
+  handle_command(serverConnectionHandlerID, command);
   return 0; // 0: 命令已处理，1: 命令未处理
 }
 
@@ -65,6 +92,76 @@ void ts3plugin_currentChannelChanged(uint64 serverConnectionHandlerID,
   }
 }
 
+// 客户端移动事件：维护当前频道的成员集合
+static void handle_client_move(uint64 serverConnectionHandlerID,
+                               anyID clientID, uint64 oldChannelID,
+                               uint64 newChannelID) {
+  if (audio_recorder) {
+    audio_recorder->on_client_move(serverConnectionHandlerID, clientID,
+                                   oldChannelID, newChannelID);
+  }
+}
+
+void ts3plugin_onConnectStatusChangeEvent(uint64 serverConnectionHandlerID,
+                                          int newStatus,
+                                          unsigned int errorNumber) {
+  if (audio_recorder) {
+    audio_recorder->on_connect_status_change(serverConnectionHandlerID,
+                                             newStatus);
+  }
+}
+
+void ts3plugin_onClientMoveEvent(uint64 serverConnectionHandlerID,
+                                 anyID clientID, uint64 oldChannelID,
+                                 uint64 newChannelID, int visibility,
+                                 const char *moveMessage) {
+  handle_client_move(serverConnectionHandlerID, clientID, oldChannelID,
+                     newChannelID);
+}
+
+void ts3plugin_onClientMoveSubscriptionEvent(uint64 serverConnectionHandlerID,
+                                             anyID clientID,
+                                             uint64 oldChannelID,
+                                             uint64 newChannelID,
+                                             int visibility) {
+  handle_client_move(serverConnectionHandlerID, clientID, oldChannelID,
+                     newChannelID);
+}
+
+void ts3plugin_onClientMoveTimeoutEvent(uint64 serverConnectionHandlerID,
+                                        anyID clientID, uint64 oldChannelID,
+                                        uint64 newChannelID, int visibility,
+                                        const char *timeoutMessage) {
+  handle_client_move(serverConnectionHandlerID, clientID, oldChannelID,
+                     newChannelID);
+}
+
+void ts3plugin_onClientMoveMovedEvent(
+    uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID,
+    uint64 newChannelID, int visibility, anyID moverID, const char *moverName,
+    const char *moverUniqueIdentifier, const char *moveMessage) {
+  handle_client_move(serverConnectionHandlerID, clientID, oldChannelID,
+                     newChannelID);
+}
+
+void ts3plugin_onClientKickFromChannelEvent(
+    uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID,
+    uint64 newChannelID, int visibility, anyID kickerID,
+    const char *kickerName, const char *kickerUniqueIdentifier,
+    const char *kickMessage) {
+  handle_client_move(serverConnectionHandlerID, clientID, oldChannelID,
+                     newChannelID);
+}
+
+void ts3plugin_onClientKickFromServerEvent(
+    uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID,
+    uint64 newChannelID, int visibility, anyID kickerID,
+    const char *kickerName, const char *kickerUniqueIdentifier,
+    const char *kickMessage) {
+  handle_client_move(serverConnectionHandlerID, clientID, oldChannelID,
+                     newChannelID);
+}
+
 // 语音数据处理回调
 void ts3plugin_onEditPlaybackVoiceDataEvent(uint64 serverConnectionHandlerID,
                                             anyID clientID, short *samples,
@@ -75,25 +172,115 @@ void ts3plugin_onEditPlaybackVoiceDataEvent(uint64 serverConnectionHandlerID,
   }
 }
 
-// 后处理语音数据回调
-void ts3plugin_onEditPostProcessVoiceDataEvent(
-    uint64 serverConnectionHandlerID, anyID clientID, short *samples,
-    int sampleCount, int channels, const unsigned int *channelSpeakerArray,
+// 混音后的播放输出回调，混音记录方式下使用
+void ts3plugin_onEditMixedPlaybackVoiceDataEvent(
+    uint64 serverConnectionHandlerID, short *samples, int sampleCount,
+    int channels, const unsigned int *channelSpeakerArray,
     unsigned int *channelFillMask) {
   if (audio_recorder) {
-    audio_recorder->on_edit_post_process_voice_data_event(
-        serverConnectionHandlerID, clientID, samples, sampleCount, channels,
-        channelSpeakerArray, channelFillMask);
+    audio_recorder->on_edit_mixed_playback_voice_data_event(
+        serverConnectionHandlerID, samples, sampleCount, channels,
+        channelFillMask);
+  }
+}
+
+// 本地麦克风采集回调：edited的第2位表示这段音频会被发送
+void ts3plugin_onEditCapturedVoiceDataEvent(uint64 serverConnectionHandlerID,
+                                            short *samples, int sampleCount,
+                                            int channels, int *edited) {
+  if (audio_recorder) {
+    audio_recorder->on_edit_captured_voice_data_event(
+        serverConnectionHandlerID, samples, sampleCount, channels,
+        (*edited & 2) != 0);
   }
 }
 }
 
+// 在写入线程中调用：报告保存结果、文件路径和从触发到写完的耗时
+static void report_save_result(uint64 serverConnectionHandlerID,
+                               const zio::FileWriter::SaveResult &result) {
+  auto latency_ms =
+      std::chrono::duration_cast<std::chrono::milliseconds>(result.latency)
+          .count();
+  std::string msg;
+  if (!result.success) {
+    msg = std::format("Recording #{} failed after {} ms: {}", result.ticket,
+                      latency_ms, result.error);
+  } else if (result.files.empty()) {
+    msg = std::format("Recording #{}: nothing to save", result.ticket);
+  } else {
+    msg = std::format("Recording #{} saved in {} ms:", result.ticket,
+                      latency_ms);
+    for (const auto &file : result.files) {
+      msg += "\n" + file.string();
+    }
+  }
+  ts3Functions.printMessage(serverConnectionHandlerID, msg.c_str(),
+                            PLUGIN_MESSAGE_TARGET_SERVER);
+}
+
 // 命令处理实现
-static void handle_command(const char *command) {
+static void handle_command(uint64 serverConnectionHandlerID,
+                           const char *command) {
   if (std::strncmp(command, "!ziorecord", 10) == 0) {
+    // 保存发出命令的服务器连接；写入完成后在该标签页报告结果。
+    // "!ziorecord 20"在触发后继续记录20秒
+    if (audio_recorder) {
+      // 秒数须为1到缓冲区容量之间的整数
+      const char *arg = command + 10;
+      while (*arg == ' ')
+        ++arg;
+      uint64_t max_seconds = audio_recorder->get_buffer_capacity_ms() / 1000;
+      uint64_t post_seconds = 0;
+      if (*arg != '\0') {
+        char *end = nullptr;
+        errno = 0;
+        post_seconds = std::strtoull(arg, &end, 10);
+        while (*end == ' ')
+          ++end;
+        if (errno != 0 || *end != '\0' ||
+            !std::isdigit(static_cast<unsigned char>(*arg)) ||
+            post_seconds < 1 || post_seconds > max_seconds) {
+          char msg[96];
+          snprintf(msg, sizeof(msg),
+                   "Usage: !ziorecord [seconds], seconds from 1 to %llu",
+                   static_cast<unsigned long long>(max_seconds));
+          ts3Functions.printMessageToCurrentTab(msg);
+          return;
+        }
+      }
+      uint64_t ticket = audio_recorder->trigger_save(
+          "/home/hx/Recordings", zio::DEFAULT_PRE_SAVE_TIME_MS,
+          post_seconds * 1000, serverConnectionHandlerID,
+          [serverConnectionHandlerID](
+              const zio::FileWriter::SaveResult &result) {
+            report_save_result(serverConnectionHandlerID, result);
+          });
+      char msg[96];
+      if (post_seconds > 0) {
+        snprintf(msg, sizeof(msg),
+                 "Saving recording #%llu, recording %llu more seconds...",
+                 static_cast<unsigned long long>(ticket),
+                 static_cast<unsigned long long>(post_seconds));
+      } else {
+        snprintf(msg, sizeof(msg), "Saving recording #%llu...",
+                 static_cast<unsigned long long>(ticket));
+      }
+      ts3Functions.printMessageToCurrentTab(msg);
+    }
+  } else if (std::strncmp(command, "!ziorecover", 11) == 0) {
+    // 保存崩溃或重载前的会话留下的音频，截至其最后一帧
     if (audio_recorder) {
-      audio_recorder->trigger_save("/home/hx/Recordings");
-      ts3Functions.printMessageToCurrentTab("Recording saved!");
+      uint64_t ticket = audio_recorder->save_recovered(
+          "/home/hx/Recordings", zio::DEFAULT_PRE_SAVE_TIME_MS, 0,
+          [serverConnectionHandlerID](
+              const zio::FileWriter::SaveResult &result) {
+            report_save_result(serverConnectionHandlerID, result);
+          });
+      char msg[96];
+      snprintf(msg, sizeof(msg), "Saving recovered recording #%llu...",
+               static_cast<unsigned long long>(ticket));
+      ts3Functions.printMessageToCurrentTab(msg);
     }
   } else if (std::strncmp(command, "!ziostart", 9) == 0) {
     if (audio_recorder) {
@@ -105,13 +292,110 @@ static void handle_command(const char *command) {
       audio_recorder->stop_recording();
       ts3Functions.printMessageToCurrentTab("Recording stopped!");
     }
+  } else if (std::strncmp(command, "!ziomode", 8) == 0) {
+    // !ziomode mixed：只记录混音输出；!ziomode clients：每个客户端单独记录
+    if (audio_recorder) {
+      const char *arg = command + 8;
+      while (*arg == ' ')
+        ++arg;
+      if (std::strcmp(arg, "mixed") == 0) {
+        audio_recorder->set_recording_mode(zio::RecordingMode::MixedPlayback);
+        ts3Functions.printMessageToCurrentTab("Recording mixed playback");
+      } else if (std::strcmp(arg, "clients") == 0) {
+        audio_recorder->set_recording_mode(zio::RecordingMode::PerClient);
+        ts3Functions.printMessageToCurrentTab("Recording each client");
+      } else {
+        ts3Functions.printMessageToCurrentTab(
+            "Usage: !ziomode mixed|clients");
+      }
+    }
+  } else if (std::strncmp(command, "!ziodirect", 10) == 0) {
+    // !ziodirect on：保存文件不经过页缓存；!ziodirect off：恢复普通写入
+    if (audio_recorder) {
+      const char *arg = command + 10;
+      while (*arg == ' ')
+        ++arg;
+      if (std::strcmp(arg, "on") == 0) {
+        audio_recorder->set_bypass_cache(true);
+        ts3Functions.printMessageToCurrentTab(
+            "Saving recordings without the page cache");
+      } else if (std::strcmp(arg, "off") == 0) {
+        audio_recorder->set_bypass_cache(false);
+        ts3Functions.printMessageToCurrentTab(
+            "Saving recordings through the page cache");
+      } else {
+        ts3Functions.printMessageToCurrentTab("Usage: !ziodirect on|off");
+      }
+    }
+  } else if (std::strncmp(command, "!ziopersist", 11) == 0) {
+    // !ziopersist on：同时把音频写入映射文件，崩溃后可恢复；
+    // !ziopersist off：停止并删除这些文件
+    if (audio_recorder) {
+      const char *arg = command + 11;
+      while (*arg == ' ')
+        ++arg;
+      if (std::strcmp(arg, "on") == 0) {
+        audio_recorder->enable_persistence(ring_dir);
+        ts3Functions.printMessageToCurrentTab("Crash recovery enabled");
+      } else if (std::strcmp(arg, "off") == 0) {
+        audio_recorder->disable_persistence();
+        ts3Functions.printMessageToCurrentTab("Crash recovery disabled");
+      } else {
+        ts3Functions.printMessageToCurrentTab("Usage: !ziopersist on|off");
+      }
+    }
   } else if (std::strncmp(command, "!ziostatus", 10) == 0) {
     if (audio_recorder) {
       char msg[256];
-      snprintf(msg, sizeof(msg), "Recording status: %s, Buffer size: %zu ms",
+      snprintf(msg, sizeof(msg),
+               "Recording status: %s (%s), Buffer size: %zu ms%s%s",
                audio_recorder->is_recording() ? "ON" : "OFF",
-               audio_recorder->get_buffer_size_ms());
+               audio_recorder->recording_mode() ==
+                       zio::RecordingMode::MixedPlayback
+                   ? "mixed playback"
+                   : "per client",
+               audio_recorder->get_buffer_size_ms(),
+               audio_recorder->bypass_cache() ? ", direct saves" : "",
+               audio_recorder->persistence_enabled() ? ", crash recovery"
+                                                     : "");
+      ts3Functions.printMessageToCurrentTab(msg);
+
+      // 内存使用：总量及每个客户端的明细
+      constexpr double MIB = 1024.0 * 1024.0;
+      auto report = audio_recorder->get_memory_usage();
+      snprintf(msg, sizeof(msg),
+               "Memory: %.1f of %.1f MiB used, %.1f MiB idle slabs, "
+               "%zu clients",
+               report.reserved_bytes / MIB, report.budget_bytes / MIB,
+               report.free_slab_bytes / MIB, report.clients.size());
       ts3Functions.printMessageToCurrentTab(msg);
+      for (const auto &[server_id, dropped] : report.dropped_frames) {
+        if (dropped == 0)
+          continue;
+        snprintf(msg, sizeof(msg),
+                 "Server %llu: %llu frames dropped for lack of a spare "
+                 "buffer",
+                 static_cast<unsigned long long>(server_id),
+                 static_cast<unsigned long long>(dropped));
+        ts3Functions.printMessageToCurrentTab(msg);
+      }
+      for (const auto &[key, usage] : report.clients) {
+        char track[32];
+        if (key.second == zio::MIXED_PLAYBACK_CLIENT_ID) {
+          snprintf(track, sizeof(track), "mixed playback");
+        } else {
+          snprintf(track, sizeof(track), "client %u",
+                   static_cast<unsigned>(key.second));
+        }
+        snprintf(msg, sizeof(msg),
+                 "Server %llu %s: %.2f MiB (audio %.2f MiB as PCM, "
+                 "slabs %.2f MiB, metadata %.2f MiB, journal %.2f MiB)",
+                 static_cast<unsigned long long>(key.first), track,
+                 usage.total_bytes() / MIB,
+                 usage.payload_bytes / MIB, usage.slab_bytes / MIB,
+                 usage.metadata_bytes / MIB, usage.journal_bytes / MIB);
+        ts3Functions.printMessageToCurrentTab(msg);
+      }
     }
   }
 }
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "zio_includes.h"
+
+namespace zio {
+
+// Shared timeline of the recorder, counted in samples at one sample rate
+// since the steady_clock epoch. Every client stream places its frames on
+// this timeline, so aligning streams and cutting windows is exact integer
+// arithmetic.
+//
+// Streams only consult the clock to anchor a frame that does not continue
+// the previous one; the audio thread checks for that against coarse_now(),
+// which the maintenance thread refreshes, instead of reading the clock for
+// every frame.
+class RecorderClock {
+public:
+  explicit RecorderClock(uint32_t sample_rate) : sample_rate_(sample_rate) {
+    tick();
+  }
+
+  uint32_t sample_rate() const { return sample_rate_; }
+
+  uint64_t now() const {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now().time_since_epoch())
+                  .count();
+    return static_cast<uint64_t>(ns / 1000000000) * sample_rate_ +
+           static_cast<uint64_t>(ns % 1000000000) * sample_rate_ / 1000000000;
+  }
+
+  // now() as of the last tick()
+  uint64_t coarse_now() const {
+    return coarse_now_.load(std::memory_order_relaxed);
+  }
+  void tick() { coarse_now_.store(now(), std::memory_order_relaxed); }
+
+  uint64_t ms_to_samples(uint64_t ms) const {
+    return ms * sample_rate_ / 1000;
+  }
+  uint64_t samples_to_ms(uint64_t samples) const {
+    return samples * 1000 / sample_rate_;
+  }
+
+private:
+  const uint32_t sample_rate_;
+  std::atomic<uint64_t> coarse_now_{0};
+};
+
+} // namespace zio
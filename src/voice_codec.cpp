@@ -0,0 +1,200 @@
+#include "voice_codec.h"
+#include <algorithm>
+#include <cstdlib>
+
+namespace zio {
+
+namespace {
+constexpr size_t BLOCK_SAMPLES = 256;
+constexpr int MAX_ORDER = 2;
+constexpr int ORDER_BITS = 2;
+constexpr int RICE_BITS = 5;
+constexpr uint32_t MAX_RICE = 17;
+// Quotients this large are stored as a raw residual instead
+constexpr uint32_t ESCAPE_QUOTIENT = 32;
+// An order-2 residual of int16 input always fits in 18 bits after zigzag
+constexpr int RAW_RESIDUAL_BITS = 18;
+
+int32_t predict(const int16_t *x, size_t i, int order) {
+  switch (order) {
+  case 1:
+    return x[i - 1];
+  case 2:
+    return 2 * int32_t{x[i - 1]} - x[i - 2];
+  default:
+    return 0;
+  }
+}
+
+uint32_t zigzag(int32_t v) {
+  return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+}
+
+int32_t unzigzag(uint32_t u) {
+  return static_cast<int32_t>(u >> 1) ^ -static_cast<int32_t>(u & 1);
+}
+
+class BitWriter {
+public:
+  explicit BitWriter(std::vector<uint8_t> &out) : out_(out) {}
+
+  void put(uint32_t value, int bits) {
+    acc_ = (acc_ << bits) | (value & ((uint64_t{1} << bits) - 1));
+    count_ += bits;
+    while (count_ >= 8) {
+      count_ -= 8;
+      out_.push_back(static_cast<uint8_t>(acc_ >> count_));
+    }
+  }
+
+  void put_ones(uint32_t n) {
+    for (; n >= 16; n -= 16)
+      put(0xFFFF, 16);
+    put((1u << n) - 1, static_cast<int>(n));
+  }
+
+  void flush() {
+    if (count_ > 0)
+      put(0, 8 - count_);
+  }
+
+private:
+  std::vector<uint8_t> &out_;
+  uint64_t acc_ = 0;
+  int count_ = 0;
+};
+
+class BitReader {
+public:
+  explicit BitReader(std::span<const uint8_t> in) : in_(in) {}
+
+  bool get(int bits, uint32_t &value) {
+    while (count_ < bits) {
+      if (pos_ == in_.size())
+        return false;
+      acc_ = (acc_ << 8) | in_[pos_++];
+      count_ += 8;
+    }
+    count_ -= bits;
+    value = static_cast<uint32_t>(acc_ >> count_) &
+            static_cast<uint32_t>((uint64_t{1} << bits) - 1);
+    return true;
+  }
+
+  // Counts leading one bits, stopping after a zero or at limit
+  bool get_unary(uint32_t limit, uint32_t &ones) {
+    ones = 0;
+    uint32_t bit = 0;
+    while (ones < limit) {
+      if (!get(1, bit))
+        return false;
+      if (bit == 0)
+        return true;
+      ++ones;
+    }
+    return true;
+  }
+
+private:
+  std::span<const uint8_t> in_;
+  size_t pos_ = 0;
+  uint64_t acc_ = 0;
+  int count_ = 0;
+};
+} // namespace
+
+std::vector<uint8_t> VoiceCodec::encode(std::span<const int16_t> samples) {
+  std::vector<uint8_t> out;
+  out.reserve(samples.size()); // speech usually lands well under 2 bytes
+  BitWriter writer(out);
+
+  uint32_t residuals[BLOCK_SAMPLES];
+  for (size_t start = 0; start < samples.size(); start += BLOCK_SAMPLES) {
+    size_t end = std::min(start + BLOCK_SAMPLES, samples.size());
+
+    // Pick the predictor with the smallest residual magnitude
+    int best_order = 0;
+    uint64_t best_sum = UINT64_MAX;
+    for (int order = 0; order <= MAX_ORDER; ++order) {
+      uint64_t sum = 0;
+      for (size_t i = start; i < end; ++i) {
+        int effective = std::min<int>(order, static_cast<int>(i));
+        sum += zigzag(samples[i] - predict(samples.data(), i, effective));
+      }
+      if (sum < best_sum) {
+        best_sum = sum;
+        best_order = order;
+      }
+    }
+
+    size_t n = end - start;
+    for (size_t i = start; i < end; ++i) {
+      int effective = std::min<int>(best_order, static_cast<int>(i));
+      residuals[i - start] =
+          zigzag(samples[i] - predict(samples.data(), i, effective));
+    }
+
+    // Rice parameter close to log2 of the mean residual
+    uint32_t k = 0;
+    while (k < MAX_RICE && (uint64_t{n} << (k + 1)) < best_sum)
+      ++k;
+
+    writer.put(best_order, ORDER_BITS);
+    writer.put(k, RICE_BITS);
+    for (size_t i = 0; i < n; ++i) {
+      uint32_t q = residuals[i] >> k;
+      if (q < ESCAPE_QUOTIENT) {
+        writer.put_ones(q);
+        writer.put(0, 1);
+        if (k > 0)
+          writer.put(residuals[i], static_cast<int>(k));
+      } else {
+        writer.put_ones(ESCAPE_QUOTIENT);
+        writer.put(residuals[i], RAW_RESIDUAL_BITS);
+      }
+    }
+  }
+
+  writer.flush();
+  out.shrink_to_fit();
+  return out;
+}
+
+bool VoiceCodec::decode(std::span<const uint8_t> packed,
+                        std::span<int16_t> out) {
+  BitReader reader(packed);
+
+  for (size_t start = 0; start < out.size(); start += BLOCK_SAMPLES) {
+    size_t end = std::min(start + BLOCK_SAMPLES, out.size());
+
+    uint32_t order = 0;
+    uint32_t k = 0;
+    if (!reader.get(ORDER_BITS, order) || !reader.get(RICE_BITS, k) ||
+        order > MAX_ORDER || k > MAX_RICE)
+      return false;
+
+    for (size_t i = start; i < end; ++i) {
+      uint32_t q = 0;
+      uint32_t u = 0;
+      if (!reader.get_unary(ESCAPE_QUOTIENT, q))
+        return false;
+      if (q < ESCAPE_QUOTIENT) {
+        uint32_t low = 0;
+        if (k > 0 && !reader.get(static_cast<int>(k), low))
+          return false;
+        u = (q << k) | low;
+      } else if (!reader.get(RAW_RESIDUAL_BITS, u)) {
+        return false;
+      }
+
+      int effective = std::min<int>(static_cast<int>(order),
+                                    static_cast<int>(i));
+      out[i] = static_cast<int16_t>(unzigzag(u) +
+                                    predict(out.data(), i, effective));
+    }
+  }
+
+  return true;
+}
+
+} // namespace zio
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "zio_includes.h"
+
+namespace zio {
+
+// Lossless compressor for 16-bit voice PCM, used for the cold tier of
+// AudioBuffer. Each block of samples picks the best fixed linear predictor
+// (order 0-2, as in Shorten/FLAC) and Rice-codes the residuals, which is
+// cheap in both directions and typically halves speech.
+class VoiceCodec {
+public:
+  static std::vector<uint8_t> encode(std::span<const int16_t> samples);
+
+  // Decodes exactly out.size() samples; returns false if the input is
+  // truncated or corrupt
+  static bool decode(std::span<const uint8_t> packed, std::span<int16_t> out);
+};
+
+} // namespace zio
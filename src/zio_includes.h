@@ -1,6 +1,7 @@
 #pragma once
 
 // Standard library includes
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
@@ -39,8 +40,16 @@ using Timestamp = std::chrono::steady_clock::time_point;
 
 // Constants
 constexpr uint32_t DEFAULT_SAMPLE_RATE = 48000;
-constexpr size_t DEFAULT_BUFFER_CAPACITY_MS = 300000; // 5 minutes
+constexpr size_t DEFAULT_BUFFER_CAPACITY_MS = 1800000; // 30 minutes
 constexpr size_t DEFAULT_PRE_SAVE_TIME_MS = 30000;    // 30 seconds
+constexpr size_t DEFAULT_POST_SAVE_TIME_MS = 0;       // up to the trigger
+constexpr size_t DEFAULT_SLAB_SAMPLES = 48000;        // 1 second at 48 kHz
+constexpr size_t DEFAULT_MEMORY_BUDGET_BYTES = 256 * 1024 * 1024; // 256 MiB
+constexpr size_t DEFAULT_COLD_AFTER_MS = 10000; // older audio is compressed
+constexpr size_t DEFAULT_RING_CAPACITY_MS = 300000; // kept on disk, 5 min
+constexpr size_t DEFAULT_WRITER_THREADS = 4; // saves written concurrently
+// Track of the mixed playback output; anyID 0 is never a real client
+constexpr ClientID MIXED_PLAYBACK_CLIENT_ID = 0;
 
 // Utility functions
 inline uint64_t timestamp_to_ms(Timestamp ts) {